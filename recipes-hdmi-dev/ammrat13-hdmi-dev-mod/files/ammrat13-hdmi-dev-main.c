@@ -0,0 +1,2432 @@
+#define pr_fmt(fmt) "ammrat13-hdmi-dev: " fmt
+#define DEBUG
+
+#include <asm/io.h>
+#include <linux/module.h>
+#include <linux/mod_devicetable.h>
+
+#include <linux/compat.h>
+#include <linux/device/driver.h>
+#include <linux/platform_device.h>
+
+#include <linux/dma-mapping.h>
+#include <linux/fb.h>
+
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+
+#include <linux/debugfs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#endif
+#include "ammrat13-hdmi-dev-neon.h"
+#include "ammrat13-hdmi-dev.h"
+
+/*******************************************************************************
+ * Constants and Helper Functions
+ ******************************************************************************/
+
+static const off_t HDMI_CTRL_OFF = 0x00l;
+static const off_t HDMI_GIE_OFF = 0x04l;
+static const off_t HDMI_IER_OFF = 0x08l;
+static const off_t HDMI_ISR_OFF = 0x0cl;
+static const off_t HDMI_BUF_OFF = 0x10l;
+static const off_t HDMI_COORD_DATA_OFF = 0x18l;
+static const off_t HDMI_COORD_CTRL_OFF = 0x1cl;
+
+static const size_t HDMI_MMIO_LEN = 0x20ul;
+static const size_t HDMI_BUF_LEN = 640ul * 480ul * 4ul;
+static const size_t HDMI_LINE_LEN = 640ul * 4ul;
+
+/*
+ * The shadow buffer used to emulate lower color depths. It has to fit the
+ * deepest emulated depth, which is 16bpp.
+ */
+static const size_t HDMI_SHADOW_LEN = 640ul * 480ul * 2ul;
+
+/*
+ * Bitmask for an interrupt that's fired on every VBlank. It's the mask into the
+ * Interrupt Status Register and the Interrupt Enable Register.
+ */
+static const u32 HDMI_VBLANK_IRQ = 0x02ul;
+
+/*
+ * The frame ID reported by the hardware is only twelve bits wide. Differences
+ * between frame IDs have to be taken modulo this.
+ */
+static const unsigned HDMI_FID_MOD = 0x1000u;
+
+/*
+ * The nominal length of a frame, which is 800x525 pixel clocks at 25.175MHz.
+ * The actual length is measured from the VBlank interrupts, but this is where
+ * the measurement starts.
+ */
+static const u64 HDMI_FRAME_NS = 16683217ull;
+
+/*
+ * Frame callbacks wake clients this long before they're predicted to need to
+ * start rendering. This covers scheduling latency, and rendering times that
+ * are a bit longer than any in the history. The wakeup itself is allowed to
+ * be late by up to the slack, so the timer can be coalesced with others.
+ */
+static const u64 HDMI_FCB_MARGIN_NS = 1000000ull;
+static const u64 HDMI_FCB_SLACK_NS = 50000ull;
+
+/*
+ * Number of past rendering times each client's prediction is based on. This
+ * has to be a macro since it sizes an array.
+ */
+#define HDMI_FCB_HISTORY 8u
+
+/*
+ * Damage is tracked in tiles of this many pixels. These have to be macros
+ * since they size arrays.
+ */
+#define HDMI_TILE_W 64u
+#define HDMI_TILE_H 16u
+#define HDMI_TILES_X (640u / HDMI_TILE_W)
+#define HDMI_TILES_Y (480u / HDMI_TILE_H)
+#define HDMI_TILES (HDMI_TILES_X * HDMI_TILES_Y)
+
+/*
+ * Counters for how much memory bandwidth and CPU time the device costs. See
+ * `hdmi_stats_add`. The bandwidth used by scanout isn't counted directly, but
+ * it's a whole buffer for every VBlank.
+ */
+enum hdmi_stat {
+	/* VBlank interrupts taken */
+	HDMI_STAT_VBLANKS,
+	/* Bytes written by user-space through `write` */
+	HDMI_STAT_WRITE_BYTES,
+	/* Bytes drawn by the framebuffer drawing operations, like for fbcon */
+	HDMI_STAT_DRAW_BYTES,
+	/* Bytes read and written by damage detection and color expansion */
+	HDMI_STAT_KERNEL_BYTES,
+	/* Time spent in the ISR */
+	HDMI_STAT_ISR_NS,
+	/* Time user-space spent waiting on VBlanks and frame callbacks */
+	HDMI_STAT_WAIT_NS,
+	HDMI_STATS,
+};
+
+struct hdmi_stats {
+	struct u64_stats_sync syncp;
+	u64_stats_t v[HDMI_STATS];
+};
+
+/*
+ * Private data for each device, stored in the `par` field of the
+ * `struct fb_info`. It's allocated along with the `struct fb_info`, so it lives
+ * exactly as long as that does.
+ */
+struct hdmi_par {
+	/* The `struct fb_info` we're embedded in */
+	struct fb_info *info;
+	/* The device registers. Their physical address is in `mmio_start`. */
+	void __iomem *mmio;
+
+	/*
+	 * The buffer the hardware scans out of. It's always 32bpp. When the
+	 * color depth is 32bpp, it's also the buffer exposed to the user.
+	 */
+	u8 *scanout;
+	dma_addr_t scanout_bus;
+	/*
+	 * The buffer exposed to the user when emulating a lower color depth.
+	 * See `hdmi_set_par`.
+	 */
+	u8 *shadow;
+	/* The palette for 8bpp pseudo-color, in the scanout's format */
+	u32 palette[256];
+
+	/*
+	 * List of `struct hdmi_client`, one for each process that has the device
+	 * open. Protected by `clients_lock`.
+	 */
+	struct list_head clients;
+	struct mutex clients_lock;
+	/* Our directory in debugfs, or an error pointer */
+	struct dentry *debugfs;
+
+	/*
+	 * Damage detection. When it's active, the buffer is compared against a
+	 * snapshot of what it held at the previous VBlank, and the tiles that
+	 * changed are published in `damage`. See `hdmi_damage_work`.
+	 *
+	 * It's active if we're emulating a lower color depth, in which case the
+	 * damaged tiles are expanded into the scanout buffer. The user can also
+	 * enable it then, but not at 32bpp, so `damage_enabled` implies
+	 * `expand`. See `hdmi_damage_set_enabled`. Setting `expand_all` forces
+	 * every tile to be expanded on the next VBlank, which is needed when
+	 * the palette changes.
+	 *
+	 * Everything here is protected by `damage_lock`, except that the ISR
+	 * reads `damage_enabled` and `expand` without it, and `expand_all` is
+	 * atomic.
+	 */
+	struct mutex damage_lock;
+	bool damage_enabled;
+	bool expand;
+	atomic_t expand_all;
+	u8 *damage_prev;
+	struct work_struct damage_work;
+	DECLARE_BITMAP(damage, HDMI_TILES);
+	u64 damage_frames;
+	u64 damage_tiles;
+	u64 damage_scan_ns;
+	u64 expand_tiles;
+	u64 expand_ns;
+
+	/*
+	 * When the last VBlank interrupt came in, and the measured length of a
+	 * frame. These are written by the ISR, so they're protected by a
+	 * spinlock rather than a mutex.
+	 */
+	spinlock_t vblank_lock;
+	u64 vblank_ns;
+	u64 frame_ns;
+
+	/*
+	 * Bandwidth and CPU accounting. The counters are per-CPU, so the hot
+	 * paths never contend on them. Once a second, `stats_work` sums them
+	 * and computes rates from the change since the last time. The rates and
+	 * the previous totals are protected by `stats_lock`.
+	 */
+	struct hdmi_stats __percpu *stats;
+	struct delayed_work stats_work;
+	struct mutex stats_lock;
+	u64 stats_prev[HDMI_STATS];
+	u64 stats_prev_ns;
+	u64 stats_rate[HDMI_STATS];
+};
+
+/*
+ * Top-level debugfs directory for the driver. Each device gets a subdirectory
+ * in here named after its framebuffer node.
+ */
+static struct dentry *hdmi_debugfs_root;
+
+/*
+ * Workqueue for deferred work triggered by the ISR. It's unbound so the work
+ * can run on whichever core is free, rather than the one taking interrupts.
+ */
+static struct workqueue_struct *hdmi_workqueue;
+
+static void hdmi_assert_types(void)
+{
+	BUILD_BUG_ON(sizeof(u8) != 1);
+	BUILD_BUG_ON(sizeof(u32) != 4);
+	BUILD_BUG_ON(sizeof(unsigned) <= 2);
+	// The bus address ends up in `smem_start`
+	BUILD_BUG_ON(sizeof(dma_addr_t) > sizeof(unsigned long));
+}
+
+/*
+ * Check the parts of the device's state that never change after probe. This
+ * is called from everywhere, including the ISR, so it MUST NOT look at anything
+ * `hdmi_set_par` changes. See `hdmi_assert_depth` for those.
+ */
+static void hdmi_assert_init(struct fb_info *info)
+{
+#ifdef DEBUG
+	BUG_ON(info == NULL);
+	BUG_ON(info->par == NULL);
+	BUG_ON(((struct hdmi_par *)info->par)->mmio == NULL);
+	BUG_ON(info->fix.mmio_start == 0ul);
+	BUG_ON(info->fix.mmio_len != HDMI_MMIO_LEN);
+	BUG_ON(info->fix.smem_start == 0ul);
+	BUG_ON(info->screen_base == NULL);
+	BUG_ON(info->pseudo_palette == NULL);
+	BUG_ON(info->fbops == NULL);
+#endif /* DEBUG */
+}
+
+/*
+ * Check that the buffer exposed to the user is consistent with the color depth.
+ * The caller MUST hold `damage_lock`, since that's what `hdmi_set_par` holds
+ * while changing all of this.
+ */
+static void hdmi_assert_depth(struct fb_info *info)
+{
+#ifdef DEBUG
+	struct hdmi_par *par = info->par;
+
+	lockdep_assert_held(&par->damage_lock);
+	BUG_ON(info->fix.smem_len != info->fix.line_length * 480ul);
+	BUG_ON(info->fix.smem_len > HDMI_BUF_LEN);
+	BUG_ON(info->screen_size != info->fix.smem_len);
+	BUG_ON(info->screen_buffer != (par->expand ? (char *)par->shadow :
+						     (char *)par->scanout));
+#endif /* DEBUG */
+}
+
+static void hdmi_assert_inbounds(off_t off)
+{
+#ifdef DEBUG
+	BUG_ON(off < 0 || off >= HDMI_MMIO_LEN);
+	BUG_ON(off % sizeof(u32) != 0);
+#endif /* DEBUG */
+}
+
+static void hdmi_iowrite32(struct fb_info *info, off_t off, u32 val)
+{
+	hdmi_assert_init(info);
+	hdmi_assert_inbounds(off);
+	iowrite32(val, ((struct hdmi_par *)info->par)->mmio + off);
+}
+
+static u32 hdmi_ioread32(struct fb_info *info, off_t off)
+{
+	hdmi_assert_init(info);
+	hdmi_assert_inbounds(off);
+	return ioread32(((struct hdmi_par *)info->par)->mmio + off);
+}
+
+/*******************************************************************************
+ * Coordinate and VBlank Handling
+ ******************************************************************************/
+
+/*
+ * This is the internal representation of coordinates, which isn't necessarily
+ * tied to hardware. It eventually gets turned into a `struct fb_vblank`.
+ */
+struct hdmi_coordinate {
+	unsigned fid;
+	unsigned row;
+	unsigned col;
+};
+
+static struct hdmi_coordinate hdmi_coordinate_read(struct fb_info *info)
+{
+	struct hdmi_coordinate ret;
+	u32 data;
+	hdmi_assert_init(info);
+	// Spin until the data is actually valid. This shouldn't take long -
+	// just a few cycles.
+	while ((hdmi_ioread32(info, HDMI_COORD_CTRL_OFF) & 1u) == 0u)
+		;
+	// Read and decode the data
+	data = hdmi_ioread32(info, HDMI_COORD_DATA_OFF);
+	ret.fid = (data >> 20) & 0xfffu;
+	ret.row = (data >> 10) & 0x3ffu;
+	ret.col = (data >> 0) & 0x3ffu;
+	return ret;
+}
+
+static bool hdmi_coordinate_is_vblank(struct hdmi_coordinate coord)
+{
+	return coord.row < 45u;
+}
+
+static bool hdmi_coordinate_is_hblank(struct hdmi_coordinate coord)
+{
+	return coord.col < 160u;
+}
+
+static bool hdmi_coordinate_is_vsync(struct hdmi_coordinate coord)
+{
+	return coord.row >= 10u && coord.row < 12u;
+}
+
+/*******************************************************************************
+ * Bandwidth and CPU Accounting
+ ******************************************************************************/
+
+/*
+ * Add to one of the counters on this CPU. This is safe to call from any
+ * context, including the ISR. The counters are 64-bit, so on 32-bit systems
+ * the update is bracketed to keep readers from seeing it half-done.
+ */
+static void hdmi_stats_add(struct hdmi_par *par, enum hdmi_stat stat, u64 val)
+{
+	struct hdmi_stats *stats;
+	unsigned long flags;
+
+	stats = get_cpu_ptr(par->stats);
+	flags = u64_stats_update_begin_irqsave(&stats->syncp);
+	u64_stats_add(&stats->v[stat], val);
+	u64_stats_update_end_irqrestore(&stats->syncp, flags);
+	put_cpu_ptr(par->stats);
+}
+
+/*
+ * Sum the counters over every CPU.
+ */
+static void hdmi_stats_read(struct hdmi_par *par, u64 totals[HDMI_STATS])
+{
+	const struct hdmi_stats *stats;
+	u64 v[HDMI_STATS];
+	unsigned start;
+	unsigned cpu;
+	unsigned i;
+
+	memset(totals, 0, HDMI_STATS * sizeof(u64));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(par->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&stats->syncp);
+			for (i = 0; i < HDMI_STATS; i++)
+				v[i] = u64_stats_read(&stats->v[i]);
+		} while (u64_stats_fetch_retry(&stats->syncp, start));
+		for (i = 0; i < HDMI_STATS; i++)
+			totals[i] += v[i];
+	}
+}
+
+/*
+ * Compute the rate of every counter over the last period, then schedule
+ * ourselves to run again in a second. The rates are per second. The counters
+ * can move by more than 2^34 in a period, say if the work is delayed, so the
+ * multiplication is done in 128 bits.
+ */
+static void hdmi_stats_work(struct work_struct *work)
+{
+	struct hdmi_par *par = container_of(to_delayed_work(work),
+					    struct hdmi_par, stats_work);
+	u64 totals[HDMI_STATS];
+	u64 now;
+	u64 elapsed;
+	unsigned i;
+
+	hdmi_stats_read(par, totals);
+	now = ktime_get_ns();
+
+	mutex_lock(&par->stats_lock);
+	elapsed = now - par->stats_prev_ns;
+	for (i = 0; i < HDMI_STATS; i++) {
+		par->stats_rate[i] =
+			elapsed == 0 ?
+				0ull :
+				mul_u64_u64_div_u64(totals[i] -
+							    par->stats_prev[i],
+						    NSEC_PER_SEC, elapsed);
+		par->stats_prev[i] = totals[i];
+	}
+	par->stats_prev_ns = now;
+	mutex_unlock(&par->stats_lock);
+
+	queue_delayed_work(hdmi_workqueue, &par->stats_work, HZ);
+}
+
+/*******************************************************************************
+ * Per-Client Statistics
+ ******************************************************************************/
+
+/*
+ * Statistics for each process that has the device open. The framebuffer core
+ * doesn't tell us which file an operation came from, so we key on the process
+ * instead. Multiple opens from the same process share an entry, and the entry
+ * is freed when the last of them is closed.
+ *
+ * Operations from processes that never opened the device themselves, say
+ * because they inherited the file, aren't attributed to anyone. The exception
+ * is frame callbacks, which need somewhere to keep their history, so they
+ * create an entry with no opens if there isn't one already. The last close
+ * can also happen in such a process, so entries whose process has exited are
+ * pruned whenever we walk the list. We hold a reference on the process's
+ * `struct pid` so that a recycled PID can't be mistaken for it.
+ */
+struct hdmi_client {
+	struct list_head node;
+	struct pid *pid;
+	char comm[TASK_COMM_LEN];
+	unsigned opens;
+
+	u64 ioctl_vblank;
+	u64 ioctl_vsync;
+	u64 ioctl_fcb;
+	u64 ioctl_other;
+	u64 vsync_wait_ns;
+	u64 bytes_written;
+	/* Number of VSync waits that landed on a new frame */
+	u64 flips;
+	/*
+	 * Number of frames between successive flips that the client didn't
+	 * wait on. This isn't the number of frames it dropped: a client that
+	 * only renders at 30 fps skips every other frame by design.
+	 */
+	u64 skipped;
+	/*
+	 * Number of presentation deadlines the client missed. That's each VSync
+	 * wait that landed later than the frame after the last flip, and each
+	 * frame callback that presented after its deadline. This does count
+	 * every flip of a client that renders at 30 fps on purpose.
+	 */
+	u64 missed;
+	/* Frame ID of the last flip, valid if `flips` is non-zero */
+	unsigned last_fid;
+
+	/*
+	 * Frame callbacks. The last few rendering times the client reported are
+	 * kept in a ring, and the prediction for the next frame is the longest
+	 * of them. See `hdmi_fcb_present`.
+	 */
+	u32 fcb_history[HDMI_FCB_HISTORY];
+	unsigned fcb_history_next;
+	/* Prediction and deadline for the frame being rendered, if any */
+	u64 fcb_predict_ns;
+	u64 fcb_deadline_ns;
+	u64 fcb_calls;
+	/* Number of frames presented before and after their deadline */
+	u64 fcb_on_time;
+	u64 fcb_late;
+	/* Number of frames that took longer to render than predicted */
+	u64 fcb_underpredicted;
+	/* Total absolute prediction error, and total time left at present */
+	u64 fcb_error_ns;
+	u64 fcb_slack_ns;
+};
+
+/*
+ * Find the entry for the current process. The caller MUST hold
+ * `clients_lock`. Returns NULL if the current process doesn't have an entry.
+ */
+static struct hdmi_client *hdmi_client_find(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+
+	lockdep_assert_held(&par->clients_lock);
+	list_for_each_entry(client, &par->clients, node) {
+		if (client->pid == task_tgid(current))
+			return client;
+	}
+	return NULL;
+}
+
+static void hdmi_client_free(struct hdmi_client *client)
+{
+	list_del(&client->node);
+	put_pid(client->pid);
+	kfree(client);
+}
+
+/*
+ * Free the entries of processes that have exited. The caller MUST hold
+ * `clients_lock`.
+ */
+static void hdmi_client_prune(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+	struct hdmi_client *tmp;
+
+	lockdep_assert_held(&par->clients_lock);
+	list_for_each_entry_safe(client, tmp, &par->clients, node) {
+		if (!pid_has_task(client->pid, PIDTYPE_TGID))
+			hdmi_client_free(client);
+	}
+}
+
+/*
+ * Find the entry for the current process, creating it if it doesn't exist. The
+ * caller MUST hold `clients_lock`. Returns NULL if we're out of memory.
+ */
+static struct hdmi_client *hdmi_client_get(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+
+	lockdep_assert_held(&par->clients_lock);
+	client = hdmi_client_find(par);
+	if (client != NULL)
+		return client;
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (client == NULL)
+		return NULL;
+	client->pid = get_task_pid(current, PIDTYPE_TGID);
+	get_task_comm(client->comm, current->group_leader);
+	list_add_tail(&client->node, &par->clients);
+	return client;
+}
+
+static int hdmi_client_open(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+
+	mutex_lock(&par->clients_lock);
+	client = hdmi_client_get(par);
+	if (client == NULL) {
+		mutex_unlock(&par->clients_lock);
+		return -ENOMEM;
+	}
+	client->opens++;
+	mutex_unlock(&par->clients_lock);
+	return 0;
+}
+
+static void hdmi_client_release(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+
+	mutex_lock(&par->clients_lock);
+	client = hdmi_client_find(par);
+	// Entries created by frame callbacks may have no opens of their own,
+	// and they're pruned when their process exits
+	if (client != NULL && client->opens != 0 && --client->opens == 0)
+		hdmi_client_free(client);
+	hdmi_client_prune(par);
+	mutex_unlock(&par->clients_lock);
+}
+
+/*
+ * Free every entry, regardless of how many times it's still open. This is only
+ * for use when tearing the device down.
+ */
+static void hdmi_client_release_all(struct hdmi_par *par)
+{
+	struct hdmi_client *client;
+	struct hdmi_client *tmp;
+
+	mutex_lock(&par->clients_lock);
+	list_for_each_entry_safe(client, tmp, &par->clients, node)
+		hdmi_client_free(client);
+	mutex_unlock(&par->clients_lock);
+}
+
+static void hdmi_client_account_ioctl(struct hdmi_par *par, unsigned int cmd)
+{
+	struct hdmi_client *client;
+
+	mutex_lock(&par->clients_lock);
+	// Frame callbacks create the entry anyway, so count the first one
+	client = cmd == HDMI_IOCTL_FRAME_CALLBACK ? hdmi_client_get(par) :
+						    hdmi_client_find(par);
+	if (client != NULL) {
+		switch (cmd) {
+		case FBIOGET_VBLANK:
+			client->ioctl_vblank++;
+			break;
+		case FBIO_WAITFORVSYNC:
+			client->ioctl_vsync++;
+			break;
+		case HDMI_IOCTL_FRAME_CALLBACK:
+			client->ioctl_fcb++;
+			break;
+		default:
+			client->ioctl_other++;
+			break;
+		}
+	}
+	mutex_unlock(&par->clients_lock);
+}
+
+/*
+ * Account for a VSync wait that took `wait_ns` and ended on frame `fid`. If the
+ * frame advanced by more than one since the client's last flip, the client
+ * skipped the frames in between, and missed the deadline for the first of them.
+ */
+static void hdmi_client_account_vsync(struct hdmi_par *par, u64 wait_ns,
+				      unsigned fid)
+{
+	struct hdmi_client *client;
+	unsigned delta;
+
+	mutex_lock(&par->clients_lock);
+	client = hdmi_client_find(par);
+	if (client != NULL) {
+		client->vsync_wait_ns += wait_ns;
+		delta = (fid - client->last_fid) % HDMI_FID_MOD;
+		if (client->flips == 0 || delta != 0) {
+			if (client->flips != 0 && delta > 1) {
+				client->skipped += delta - 1;
+				client->missed++;
+			}
+			client->flips++;
+			client->last_fid = fid;
+		}
+	}
+	mutex_unlock(&par->clients_lock);
+}
+
+static void hdmi_client_account_write(struct hdmi_par *par, size_t bytes)
+{
+	struct hdmi_client *client;
+
+	mutex_lock(&par->clients_lock);
+	client = hdmi_client_find(par);
+	if (client != NULL)
+		client->bytes_written += bytes;
+	mutex_unlock(&par->clients_lock);
+}
+
+/*
+ * Dump the statistics for every client as a table in debugfs. This is what
+ * DRM drivers would put in `/proc/<pid>/fdinfo`, but the framebuffer core
+ * doesn't give us a way to hook that.
+ */
+static int hdmi_clients_show(struct seq_file *m, void *unused)
+{
+	struct fb_info *info = m->private;
+	struct hdmi_par *par;
+	struct hdmi_client *client;
+
+	hdmi_assert_init(info);
+	par = info->par;
+
+	seq_printf(m,
+		   "%8s %-16s %5s %10s %10s %10s %10s %12s %12s %10s %10s %10s\n",
+		   "pid", "comm", "opens", "getvblank", "waitvsync", "framecb",
+		   "other", "vsync_ms", "written", "flips", "skipped",
+		   "missed");
+	mutex_lock(&par->clients_lock);
+	hdmi_client_prune(par);
+	list_for_each_entry(client, &par->clients, node) {
+		seq_printf(m,
+			   "%8d %-16s %5u %10llu %10llu %10llu %10llu %12llu %12llu %10llu %10llu %10llu\n",
+			   pid_nr(client->pid), client->comm, client->opens,
+			   client->ioctl_vblank, client->ioctl_vsync,
+			   client->ioctl_fcb, client->ioctl_other,
+			   div_u64(client->vsync_wait_ns, NSEC_PER_MSEC),
+			   client->bytes_written, client->flips,
+			   client->skipped, client->missed);
+	}
+	mutex_unlock(&par->clients_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hdmi_clients);
+
+/*******************************************************************************
+ * Damage Detection
+ ******************************************************************************/
+
+/*
+ * Compare a tile against the snapshot, and update the snapshot if it changed.
+ * This uses NEON if we can, and MUST be called between `hdmi_simd_begin` and
+ * `hdmi_simd_end`. See `hdmi_neon_tile_sync` for the arguments.
+ */
+static bool hdmi_tile_sync(const u8 *cur, u8 *prev, size_t stride, size_t len,
+			   unsigned lines)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	return hdmi_neon_tile_sync(cur, prev, stride, len, lines);
+#else
+	unsigned line;
+
+	for (line = 0; line < lines; line++) {
+		if (memcmp(cur + line * stride, prev + line * stride, len) != 0)
+			break;
+	}
+	if (line == lines)
+		return false;
+	for (; line < lines; line++)
+		memcpy(prev + line * stride, cur + line * stride, len);
+	return true;
+#endif /* CONFIG_KERNEL_MODE_NEON */
+}
+
+static void hdmi_simd_begin(void)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	kernel_neon_begin();
+#endif
+}
+
+static void hdmi_simd_end(void)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+	kernel_neon_end();
+#endif
+}
+
+/*
+ * Expand a tile from the snapshot of the shadow buffer into the scanout buffer.
+ * We expand from the snapshot rather than the shadow since the snapshot is
+ * exactly what we compared against. This MUST be called between
+ * `hdmi_simd_begin` and `hdmi_simd_end`.
+ *
+ * There's no NEON routine for 8bpp. A 256-entry lookup table doesn't fit in
+ * the NEON table lookup instructions, so it wouldn't beat plain loads.
+ */
+static void hdmi_expand_tile(struct hdmi_par *par, unsigned tx, unsigned ty)
+{
+	struct fb_info *info = par->info;
+	size_t src_stride = info->fix.line_length;
+	size_t src_bpp = src_stride / 640u;
+	const u8 *src = par->damage_prev + ty * HDMI_TILE_H * src_stride +
+			tx * HDMI_TILE_W * src_bpp;
+	u8 *dst = par->scanout + ty * HDMI_TILE_H * HDMI_LINE_LEN +
+		  tx * HDMI_TILE_W * 4u;
+	unsigned line;
+	unsigned i;
+
+	if (src_bpp == 2u) {
+#ifdef CONFIG_KERNEL_MODE_NEON
+		hdmi_neon_expand_rgb565(src, src_stride, dst, HDMI_LINE_LEN,
+					HDMI_TILE_W, HDMI_TILE_H);
+#else
+		for (line = 0; line < HDMI_TILE_H; line++) {
+			const u16 *s = (const u16 *)(src + line * src_stride);
+			u32 *d = (u32 *)(dst + line * HDMI_LINE_LEN);
+			for (i = 0; i < HDMI_TILE_W; i++) {
+				u32 r = (s[i] >> 11) & 0x1fu;
+				u32 g = (s[i] >> 5) & 0x3fu;
+				u32 b = (s[i] >> 0) & 0x1fu;
+				d[i] = (((r << 3) | (r >> 2)) << 16) |
+				       (((g << 2) | (g >> 4)) << 8) |
+				       (((b << 3) | (b >> 2)) << 0);
+			}
+		}
+#endif /* CONFIG_KERNEL_MODE_NEON */
+		return;
+	}
+
+	BUG_ON(src_bpp != 1u);
+	for (line = 0; line < HDMI_TILE_H; line++) {
+		const u8 *s = src + line * src_stride;
+		u32 *d = (u32 *)(dst + line * HDMI_LINE_LEN);
+		for (i = 0; i < HDMI_TILE_W; i++)
+			d[i] = par->palette[s[i]];
+	}
+}
+
+/*
+ * Scan the whole buffer for damage. This is queued by the ISR on every VBlank
+ * while damage detection is active. When emulating a lower color depth, this
+ * is also where the damaged tiles get expanded into the scanout buffer, so
+ * updates are paced by VBlank.
+ *
+ * Using NEON disables preemption, so we only hold it for one row of tiles at a
+ * time. We only ever scan the shadow buffer, which is cached, since damage
+ * detection is never active at 32bpp. We still stop comparing a tile at the
+ * first line that differs.
+ */
+static void hdmi_damage_work(struct work_struct *work)
+{
+	struct hdmi_par *par = container_of(work, struct hdmi_par, damage_work);
+	struct fb_info *info = par->info;
+	DECLARE_BITMAP(damage, HDMI_TILES);
+	const u8 *cur;
+	size_t stride;
+	size_t tile_len;
+	unsigned tx;
+	unsigned ty;
+	u64 start;
+	hdmi_assert_init(info);
+
+	mutex_lock(&par->damage_lock);
+	if (!par->damage_enabled && !par->expand) {
+		mutex_unlock(&par->damage_lock);
+		return;
+	}
+	hdmi_assert_depth(info);
+
+	start = ktime_get_ns();
+	cur = (const u8 *)info->screen_buffer;
+	stride = info->fix.line_length;
+	// Derive the depth from the buffer rather than `info->var`, since the
+	// latter changes before `hdmi_set_par` swaps the buffers
+	tile_len = HDMI_TILE_W * stride / 640u;
+	bitmap_zero(damage, HDMI_TILES);
+
+	for (ty = 0; ty < HDMI_TILES_Y; ty++) {
+		size_t row_off = ty * HDMI_TILE_H * stride;
+
+		hdmi_simd_begin();
+		for (tx = 0; tx < HDMI_TILES_X; tx++) {
+			size_t off = row_off + tx * tile_len;
+			if (hdmi_tile_sync(cur + off, par->damage_prev + off,
+					   stride, tile_len, HDMI_TILE_H))
+				__set_bit(ty * HDMI_TILES_X + tx, damage);
+		}
+		hdmi_simd_end();
+	}
+
+	bitmap_copy(par->damage, damage, HDMI_TILES);
+	par->damage_frames++;
+	par->damage_tiles += bitmap_weight(damage, HDMI_TILES);
+	par->damage_scan_ns += ktime_get_ns() - start;
+	// The whole buffer is read, and damaged tiles are copied into the
+	// snapshot. Count whole tiles, even though the copy may start partway.
+	hdmi_stats_add(par, HDMI_STAT_KERNEL_BYTES,
+		       info->screen_size + bitmap_weight(damage, HDMI_TILES) *
+						   tile_len * HDMI_TILE_H);
+
+	if (par->expand) {
+		start = ktime_get_ns();
+		if (atomic_xchg(&par->expand_all, 0) != 0)
+			bitmap_fill(damage, HDMI_TILES);
+		for (ty = 0; ty < HDMI_TILES_Y; ty++) {
+			hdmi_simd_begin();
+			for (tx = 0; tx < HDMI_TILES_X; tx++) {
+				if (test_bit(ty * HDMI_TILES_X + tx, damage))
+					hdmi_expand_tile(par, tx, ty);
+			}
+			hdmi_simd_end();
+		}
+		par->expand_tiles += bitmap_weight(damage, HDMI_TILES);
+		par->expand_ns += ktime_get_ns() - start;
+		// Each tile is read from the snapshot and written to scanout
+		hdmi_stats_add(par, HDMI_STAT_KERNEL_BYTES,
+			       bitmap_weight(damage, HDMI_TILES) *
+				       (tile_len + HDMI_TILE_W * 4u) *
+				       HDMI_TILE_H);
+	}
+	mutex_unlock(&par->damage_lock);
+}
+
+/*
+ * Start tracking damage from what's in the buffer now. This is called whenever
+ * damage detection becomes active, or when the buffer it's tracking changes.
+ * The caller MUST hold `damage_lock`.
+ *
+ * The snapshot is allocated in the probe function, so this can't fail. That
+ * matters because `hdmi_set_par` has no way to back out of a depth change.
+ */
+static void hdmi_damage_start(struct hdmi_par *par)
+{
+	struct fb_info *info = par->info;
+
+	lockdep_assert_held(&par->damage_lock);
+	memcpy(par->damage_prev, info->screen_buffer, info->screen_size);
+	hdmi_stats_add(par, HDMI_STAT_KERNEL_BYTES, 2u * info->screen_size);
+	bitmap_zero(par->damage, HDMI_TILES);
+	// The scanout buffer may not match the snapshot we just took, so make
+	// sure it gets completely redrawn
+	atomic_set(&par->expand_all, 1);
+}
+
+/*
+ * Turn damage detection on or off at the user's request. If we're emulating a
+ * lower color depth, it stays active regardless.
+ *
+ * It can't be turned on at 32bpp. There, the buffer is the write-combined
+ * scanout, which has no cached copy, so an idle screen would cost reading all
+ * 1.2MB of it on every VBlank, and nothing in the driver would use the result.
+ * Returns -EINVAL in that case. Switching to 32bpp also turns it off. See
+ * `hdmi_set_par`.
+ */
+static int hdmi_damage_set_enabled(struct fb_info *info, bool enable)
+{
+	struct hdmi_par *par;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	mutex_lock(&par->damage_lock);
+	if (enable && !par->expand) {
+		mutex_unlock(&par->damage_lock);
+		return -EINVAL;
+	}
+	// We're already tracking damage for emulation, so the snapshot is
+	// already up to date
+	WRITE_ONCE(par->damage_enabled, enable);
+	mutex_unlock(&par->damage_lock);
+	return 0;
+}
+
+/*
+ * Dump the damage detection statistics to debugfs, along with a map of the
+ * last frame's damage. Each character in the map is one tile.
+ */
+static int hdmi_damage_show(struct seq_file *m, void *unused)
+{
+	struct fb_info *info = m->private;
+	struct hdmi_par *par;
+	unsigned tx;
+	unsigned ty;
+
+	hdmi_assert_init(info);
+	par = info->par;
+
+	mutex_lock(&par->damage_lock);
+	seq_printf(m, "enabled: %d\n", par->damage_enabled);
+	seq_printf(m, "frames: %llu\n", par->damage_frames);
+	seq_printf(m, "tiles: %llu\n", par->damage_tiles);
+	seq_printf(m, "scan_ns: %llu\n", par->damage_scan_ns);
+	seq_printf(m, "expanding: %d\n", par->expand);
+	seq_printf(m, "expand_tiles: %llu\n", par->expand_tiles);
+	seq_printf(m, "expand_ns: %llu\n", par->expand_ns);
+	for (ty = 0; ty < HDMI_TILES_Y; ty++) {
+		for (tx = 0; tx < HDMI_TILES_X; tx++)
+			seq_putc(m, test_bit(ty * HDMI_TILES_X + tx,
+					     par->damage) ?
+					    '#' :
+					    '.');
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&par->damage_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hdmi_damage);
+
+/*******************************************************************************
+ * Frame Callbacks
+ ******************************************************************************/
+
+/*
+ * Clients that render right after `FBIO_WAITFORVSYNC` returns have their frame
+ * sit in the buffer for almost a whole frame before it's scanned out. Frame
+ * callbacks instead wake the client just early enough to finish rendering
+ * before the next VBlank, so what's on screen is as fresh as possible.
+ *
+ * To do that, the client reports how long each frame took to render when it
+ * presents it. The driver predicts the next frame will take as long as the
+ * longest of the last few, and sleeps the client until the next VBlank minus
+ * the prediction minus a margin. The VBlank is extrapolated from the last
+ * VBlank interrupt, using the measured frame length.
+ *
+ * Rendering times are clamped to less than one frame, less the margin. A
+ * client that takes longer can't be helped by waking it earlier anyway, and
+ * the clamp bounds every sleep to under one frame.
+ */
+
+/*
+ * Record the time of a VBlank. This is called from the ISR, so it has to be
+ * cheap. Intervals that aren't about one frame long are from missed interrupts,
+ * so they're left out of the frame length.
+ */
+static void hdmi_fcb_vblank(struct hdmi_par *par)
+{
+	u64 now = ktime_get_ns();
+	u64 delta;
+
+	spin_lock(&par->vblank_lock);
+	delta = now - par->vblank_ns;
+	if (delta > HDMI_FRAME_NS - (HDMI_FRAME_NS >> 2) &&
+	    delta < HDMI_FRAME_NS + (HDMI_FRAME_NS >> 2))
+		par->frame_ns = par->frame_ns - (par->frame_ns >> 4) +
+				(delta >> 4);
+	par->vblank_ns = now;
+	spin_unlock(&par->vblank_lock);
+}
+
+/*
+ * Account for the frame the current process is presenting, which took
+ * `render_ns` to render, then predict how long its next frame will take and
+ * work out which VBlank it should target. Returns the time to wake the
+ * process, or `-ENOMEM` if it has no entry and one can't be allocated.
+ */
+static s64 hdmi_fcb_present(struct hdmi_par *par,
+			    struct hdmi_frame_callback *fcb)
+{
+	struct hdmi_client *client;
+	unsigned long flags;
+	u64 vblank;
+	u64 period;
+	u64 now;
+	u64 lead;
+	u64 deadline;
+	unsigned i;
+
+	spin_lock_irqsave(&par->vblank_lock, flags);
+	vblank = par->vblank_ns;
+	period = par->frame_ns;
+	spin_unlock_irqrestore(&par->vblank_lock, flags);
+
+	mutex_lock(&par->clients_lock);
+	client = hdmi_client_get(par);
+	if (client == NULL) {
+		mutex_unlock(&par->clients_lock);
+		return -ENOMEM;
+	}
+	now = ktime_get_ns();
+	client->fcb_calls++;
+
+	// See how the last prediction held up. We only know if the client is
+	// actually presenting something.
+	if (fcb->render_ns != 0 && client->fcb_deadline_ns != 0) {
+		if (now <= client->fcb_deadline_ns) {
+			client->fcb_on_time++;
+			client->fcb_slack_ns += client->fcb_deadline_ns - now;
+		} else {
+			client->fcb_late++;
+			client->missed++;
+		}
+		if (fcb->render_ns > client->fcb_predict_ns) {
+			client->fcb_underpredicted++;
+			client->fcb_error_ns +=
+				fcb->render_ns - client->fcb_predict_ns;
+		} else {
+			client->fcb_error_ns +=
+				client->fcb_predict_ns - fcb->render_ns;
+		}
+	}
+	if (fcb->render_ns != 0) {
+		client->fcb_history[client->fcb_history_next] =
+			min_t(u64, fcb->render_ns,
+			      period - HDMI_FCB_MARGIN_NS - 1u);
+		client->fcb_history_next =
+			(client->fcb_history_next + 1) % HDMI_FCB_HISTORY;
+	}
+
+	fcb->predict_ns = 0;
+	for (i = 0; i < HDMI_FCB_HISTORY; i++)
+		fcb->predict_ns = max_t(u64, fcb->predict_ns,
+					client->fcb_history[i]);
+	// The history was clamped against the frame length at the time, which
+	// may have been longer
+	fcb->predict_ns =
+		min_t(u64, fcb->predict_ns, period - HDMI_FCB_MARGIN_NS - 1u);
+
+	// Target the first VBlank we can still wake the client in time for.
+	// Only whole frames are skipped, so the deadline stays in phase with
+	// the last interrupt.
+	lead = fcb->predict_ns + HDMI_FCB_MARGIN_NS;
+	deadline = vblank + period;
+	if (deadline < now + lead)
+		deadline += period * div64_u64(now + lead - deadline +
+							period - 1,
+						period);
+	fcb->deadline_ns = deadline;
+
+	client->fcb_predict_ns = fcb->predict_ns;
+	client->fcb_deadline_ns = deadline;
+	mutex_unlock(&par->clients_lock);
+	return deadline - lead;
+}
+
+/*
+ * Sleep until `wake_ns` on a high-resolution timer. Returns `0` on success or
+ * `-EINTR` if a signal came in first.
+ */
+static int hdmi_fcb_sleep_until(u64 wake_ns)
+{
+	ktime_t expires = ns_to_ktime(wake_ns);
+
+	while (ktime_before(ktime_get(), expires)) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout_range(&expires, HDMI_FCB_SLACK_NS,
+					 HRTIMER_MODE_ABS);
+		if (signal_pending(current))
+			return -EINTR;
+	}
+	return 0;
+}
+
+/*
+ * Dump the frame callback statistics for every client that has used them. The
+ * averages are in microseconds.
+ */
+static int hdmi_fcb_show(struct seq_file *m, void *unused)
+{
+	struct fb_info *info = m->private;
+	struct hdmi_par *par;
+	struct hdmi_client *client;
+	unsigned long flags;
+	u64 period;
+
+	hdmi_assert_init(info);
+	par = info->par;
+
+	spin_lock_irqsave(&par->vblank_lock, flags);
+	period = par->frame_ns;
+	spin_unlock_irqrestore(&par->vblank_lock, flags);
+	seq_printf(m, "frame_ns: %llu\n", period);
+	seq_printf(m, "margin_ns: %llu\n", HDMI_FCB_MARGIN_NS);
+
+	seq_printf(m, "%8s %-16s %10s %10s %10s %10s %10s %10s %10s\n", "pid",
+		   "comm", "calls", "on_time", "late", "under", "predict_us",
+		   "error_us", "slack_us");
+	mutex_lock(&par->clients_lock);
+	hdmi_client_prune(par);
+	list_for_each_entry(client, &par->clients, node) {
+		u64 outcomes = client->fcb_on_time + client->fcb_late;
+
+		if (client->fcb_calls == 0)
+			continue;
+		seq_printf(m,
+			   "%8d %-16s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+			   pid_nr(client->pid), client->comm, client->fcb_calls,
+			   client->fcb_on_time, client->fcb_late,
+			   client->fcb_underpredicted,
+			   div_u64(client->fcb_predict_ns, NSEC_PER_USEC),
+			   outcomes == 0 ? 0ull :
+					   div64_u64(client->fcb_error_ns,
+						     outcomes * NSEC_PER_USEC),
+			   client->fcb_on_time == 0 ?
+				   0ull :
+				   div64_u64(client->fcb_slack_ns,
+					     client->fcb_on_time *
+						     NSEC_PER_USEC));
+	}
+	mutex_unlock(&par->clients_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hdmi_fcb);
+
+/*******************************************************************************
+ * Interrupt Handling
+ ******************************************************************************/
+
+/*
+ * This wait queue is signaled on every VBlank by the ISR. All the threads
+ * waiting on this MUST be interruptible, especially since it takes a long time
+ * for the interrupts to come in.
+ */
+DECLARE_WAIT_QUEUE_HEAD(hdmi_vblank_waitq);
+
+static irqreturn_t hdmi_isr(int irq, void *info_cookie)
+{
+	struct fb_info *info;
+	struct hdmi_par *par;
+	u64 start;
+	u32 isr;
+
+	// The routine establishing this IRQ handler MUST pass us the
+	// `struct fb_info` data in the cookie.
+	info = info_cookie;
+	hdmi_assert_init(info);
+	par = info->par;
+	start = ktime_get_ns();
+
+	// Check to see if we even have an interrupt from this device
+	if ((hdmi_ioread32(info, HDMI_CTRL_OFF) & 0x200u) == 0u)
+		return IRQ_NONE;
+	// If we do, read the Interrupt Status Register to find out what interrupts
+	// we need to service. We should only have an interrupt for a new frame.
+	isr = hdmi_ioread32(info, HDMI_ISR_OFF);
+	BUG_ON(isr == 0);
+	WARN_ON_ONCE(isr != HDMI_VBLANK_IRQ);
+
+	hdmi_fcb_vblank(par);
+	wake_up_interruptible_all(&hdmi_vblank_waitq);
+	if (READ_ONCE(par->damage_enabled) || READ_ONCE(par->expand))
+		queue_work(hdmi_workqueue, &par->damage_work);
+	hdmi_iowrite32(info, HDMI_ISR_OFF, isr);
+
+	hdmi_stats_add(par, HDMI_STAT_VBLANKS, 1u);
+	hdmi_stats_add(par, HDMI_STAT_ISR_NS, ktime_get_ns() - start);
+	return IRQ_HANDLED;
+}
+
+/*******************************************************************************
+ * Framebuffer Structures
+ ******************************************************************************/
+
+static int hdmi_open(struct fb_info *info, int user);
+static int hdmi_release(struct fb_info *info, int user);
+static ssize_t hdmi_write(struct fb_info *info, const char __user *buf,
+			  size_t count, loff_t *ppos);
+static void hdmi_fillrect(struct fb_info *info,
+			  const struct fb_fillrect *rect);
+static void hdmi_copyarea(struct fb_info *info,
+			  const struct fb_copyarea *area);
+static void hdmi_imageblit(struct fb_info *info, const struct fb_image *image);
+static int hdmi_setcolreg(unsigned regno, unsigned red, unsigned green,
+			  unsigned blue, unsigned transp, struct fb_info *info);
+static int hdmi_check_var(struct fb_var_screeninfo *var, struct fb_info *info);
+static int hdmi_mmap(struct fb_info *info, struct vm_area_struct *vma);
+static int hdmi_ioctl(struct fb_info *info, unsigned int cmd,
+		      unsigned long arg);
+#ifdef CONFIG_COMPAT
+static int hdmi_compat_ioctl(struct fb_info *info, unsigned int cmd,
+			     unsigned long arg);
+#endif
+static int hdmi_set_par(struct fb_info *info);
+
+static struct fb_fix_screeninfo hdmi_fix_init = {
+	/*
+	 * Still have to set:
+	 *   * `.smem_start`
+	 *   * `.mmio_start`
+	 */
+	.id = "ammrat13-fb",
+	.smem_len = HDMI_BUF_LEN,
+	.type = FB_TYPE_PACKED_PIXELS,
+	.visual = FB_VISUAL_TRUECOLOR,
+	.xpanstep = 0,
+	.ypanstep = 0,
+	.ywrapstep = 0,
+	.line_length = HDMI_LINE_LEN,
+	.mmio_len = HDMI_MMIO_LEN,
+	.accel = FB_ACCEL_NONE,
+	.capabilities = 0,
+};
+
+static struct fb_var_screeninfo hdmi_var_init = {
+	/*
+	 * Timing fields are taken from: drivers/video/fbdev/core/modedb.c.
+	 * Specifically, see the entries in `modedb`, and look at the conversion
+	 * in `fb_videomode_to_var`.
+	 */
+	.xres = 640,
+	.yres = 480,
+	.xres_virtual = 640,
+	.yres_virtual = 480,
+	.xoffset = 0,
+	.yoffset = 0,
+	.bits_per_pixel = 32,
+	.grayscale = 0,
+	.red = { .offset = 16, .length = 8, .msb_right = 0 },
+	.green = { .offset = 8, .length = 8, .msb_right = 0 },
+	.blue = { .offset = 0, .length = 8, .msb_right = 0 },
+	.transp = { .offset = 24, .length = 0, .msb_right = 0 },
+	.nonstd = 0,
+	.height = -1,
+	.width = -1,
+	.pixclock = 39721u,
+	.left_margin = 40u,
+	.right_margin = 24u,
+	.upper_margin = 32u,
+	.lower_margin = 11u,
+	.hsync_len = 96u,
+	.vsync_len = 2u,
+	.sync = FB_SYNC_HOR_HIGH_ACT | FB_SYNC_VERT_HIGH_ACT,
+	.vmode = FB_VMODE_NONINTERLACED,
+};
+
+static struct fb_ops hdmi_fbops = {
+	.owner = THIS_MODULE,
+	.fb_open = hdmi_open,
+	.fb_release = hdmi_release,
+	.fb_read = fb_sys_read,
+	.fb_write = hdmi_write,
+	.fb_check_var = hdmi_check_var,
+	.fb_set_par = hdmi_set_par,
+	.fb_setcolreg = hdmi_setcolreg,
+	/* .fb_setcmap iteratively calls .fb_setcolreg by default */
+	/* .fb_blank errors by default */
+	/* .fb_pan_display errors by default */
+	.fb_fillrect = hdmi_fillrect,
+	.fb_copyarea = hdmi_copyarea,
+	.fb_imageblit = hdmi_imageblit,
+	/* .fb_cursor uses a software cursor by default */
+	/* .fb_sync is a no-op by default */
+	.fb_ioctl = hdmi_ioctl,
+#ifdef CONFIG_COMPAT
+	.fb_compat_ioctl = hdmi_compat_ioctl,
+#endif
+	.fb_mmap = hdmi_mmap,
+	/* .fb_destroy does nothing special by default */
+};
+
+/*******************************************************************************
+ * Framebuffer Operations
+ *
+ * Note that these were forward-declared in the previous section. Make sure to
+ * add them there to register them in `hdmi_fbops`.
+ ******************************************************************************/
+
+/*
+ * We don't multiplex users, but we do keep statistics on them. Opens from the
+ * kernel, i.e. the console, aren't tracked.
+ */
+static int hdmi_open(struct fb_info *info, int user)
+{
+	if (WARN_ON(info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+
+	if (!user)
+		return 0;
+	return hdmi_client_open(info->par);
+}
+
+static int hdmi_release(struct fb_info *info, int user)
+{
+	if (WARN_ON(info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+
+	if (user)
+		hdmi_client_release(info->par);
+	return 0;
+}
+
+/*
+ * Writes go through the default implementation. We just count the bytes that
+ * made it to the buffer.
+ */
+static ssize_t hdmi_write(struct fb_info *info, const char __user *buf,
+			  size_t count, loff_t *ppos)
+{
+	ssize_t res;
+
+	if (WARN_ON(info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+
+	res = fb_sys_write(info, buf, count, ppos);
+	if (res > 0) {
+		hdmi_client_account_write(info->par, res);
+		hdmi_stats_add(info->par, HDMI_STAT_WRITE_BYTES, res);
+	}
+	return res;
+}
+
+/*
+ * The drawing operations are the generic ones. We only wrap them to account
+ * for the bytes they read and write.
+ */
+static void hdmi_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+	cfb_fillrect(info, rect);
+	hdmi_stats_add(info->par, HDMI_STAT_DRAW_BYTES,
+		       rect->width * rect->height *
+			       info->var.bits_per_pixel / 8u);
+}
+
+static void hdmi_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+	cfb_copyarea(info, area);
+	// The source is read from the buffer and then written back, so count
+	// it twice, like the snapshot copy in damage detection
+	hdmi_stats_add(info->par, HDMI_STAT_DRAW_BYTES,
+		       2u * area->width * area->height *
+			       info->var.bits_per_pixel / 8u);
+}
+
+static void hdmi_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+	cfb_imageblit(info, image);
+	hdmi_stats_add(info->par, HDMI_STAT_DRAW_BYTES,
+		       image->width * image->height *
+			       info->var.bits_per_pixel / 8u);
+}
+
+/*
+ * For true-color mode, the kernel expects us to allocate and manage a pseudo
+ * palette. This is the function the kernel uses to set entries in that. We
+ * allocated it in the probe function.
+ *
+ * For 8bpp pseudo-color mode, this sets entries in the real palette instead.
+ * That palette is used when expanding the shadow buffer into the scanout
+ * buffer, and it's always in the scanout buffer's format.
+ */
+static int hdmi_setcolreg(unsigned regno, unsigned red, unsigned green,
+			  unsigned blue, unsigned transp, struct fb_info *info)
+{
+	struct hdmi_par *par;
+	const struct fb_bitfield *r;
+	const struct fb_bitfield *g;
+	const struct fb_bitfield *b;
+
+	/*
+	 * The inputs to this function are 16-bit, so convert to the width of
+	 * each field. The conversion here isn't just a simple shift, though
+	 * that would work. The actual ratio is (2**16 - 1) / (2**w - 1). The
+	 * formula below is used elsewhere in the kernel to get the true
+	 * closest answer for that ratio.
+	 */
+#define CNVT_TOHW(val, width) ((((val) << (width)) + 0x7fff - (val)) >> 16)
+
+#if 0
+	// This has a tendancy to spam the log, so we disable it. The checks
+	// should still happen after the print, though.
+	pr_debug("setting color register %u to (%u, %u, %u, %u)\n", regno, red,
+		 green, blue, transp);
+#endif
+	if (WARN_ON(info == NULL))
+		return 1;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	if (info->fix.visual == FB_VISUAL_PSEUDOCOLOR) {
+		if (regno >= ARRAY_SIZE(par->palette))
+			return 1;
+		// The fields here MUST match `hdmi_var_init`
+		WRITE_ONCE(par->palette[regno],
+			   (CNVT_TOHW(red, 8) << 16) |
+				   (CNVT_TOHW(green, 8) << 8) |
+				   (CNVT_TOHW(blue, 8) << 0));
+		// Every pixel using this entry has to be redrawn
+		atomic_set(&par->expand_all, 1);
+		return 0;
+	}
+
+	// The pseudo palette is expected to be 16 entries long, and that's
+	// exactly what we allocated
+	if (regno >= 16)
+		return 1;
+
+	// Pack according to the current format, which `hdmi_check_var` set
+	r = &info->var.red;
+	g = &info->var.green;
+	b = &info->var.blue;
+	((u32 *)info->pseudo_palette)[regno] =
+		(CNVT_TOHW(red, r->length) << r->offset) |
+		(CNVT_TOHW(green, g->length) << g->offset) |
+		(CNVT_TOHW(blue, b->length) << b->offset);
+	return 0;
+#undef CNVT_TOHW
+}
+
+/*
+ * This function gates user changes to the framebuffer geometry. The hardware
+ * only supports one configuration, though. So, we check if the thing passed
+ * in is close enough, modifying it if it is and erroring otherwise.
+ *
+ * The one exception is the color depth. The hardware is always 32bpp, but we
+ * emulate 16bpp RGB565 and 8bpp pseudo-color. See `hdmi_set_par`.
+ */
+static int hdmi_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
+{
+	pr_info("called check_var for %p on %p\n", var, info);
+	if (WARN_ON(var == NULL || info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+
+	// It appears that we're responsible for rounding up impossible values
+	if (var->xres_virtual < var->xres)
+		var->xres_virtual = var->xres;
+	if (var->yres_virtual < var->yres)
+		var->yres_virtual = var->yres;
+
+	// The resolution is fixed by the hardware, ...
+	if (var->xres != 640 || var->yres != 480) {
+		pr_info("-> resolution mismatch\n");
+		return -EINVAL;
+	}
+	// ... as is the virtual resolution, ...
+	if (var->xres_virtual != 640 || var->yres_virtual != 480) {
+		pr_info("-> virtual resolution mismatch\n");
+		return -EINVAL;
+	}
+	// ... the buffer structure, ...
+	if ((var->vmode & FB_VMODE_MASK) != FB_VMODE_NONINTERLACED) {
+		pr_info("-> incorrect buffer structure\n");
+		return -EINVAL;
+	}
+	// ... and the color depth, though we can emulate some.
+	if ((var->bits_per_pixel != 32 && var->bits_per_pixel != 16 &&
+	     var->bits_per_pixel != 8) ||
+	    var->grayscale != 0) {
+		pr_info("-> color depth mismatch\n");
+		return -EINVAL;
+	}
+	// We don't support hardware panning.
+	if (var->xoffset != 0 || var->yoffset != 0) {
+		pr_info("-> panning not supported\n");
+		return -EINVAL;
+	}
+
+	/*
+	 * If the request is close enough, modify the rest of the fields to
+	 * match what we actually have. Note that this doesn't touch:
+	 *  * `.activate`, nor
+	 *  * `.rotate` since that's handled in software.
+	 */
+	{
+		var->red = hdmi_var_init.red;
+		var->green = hdmi_var_init.green;
+		var->blue = hdmi_var_init.blue;
+		var->transp = hdmi_var_init.transp;
+		var->nonstd = hdmi_var_init.nonstd;
+
+		// Emulated depths have their own layouts. For pseudo-color,
+		// the fields describe the palette entries, not the pixels.
+		if (var->bits_per_pixel == 16) {
+			var->red = (struct fb_bitfield){ .offset = 11,
+							 .length = 5 };
+			var->green = (struct fb_bitfield){ .offset = 5,
+							   .length = 6 };
+			var->blue = (struct fb_bitfield){ .offset = 0,
+							  .length = 5 };
+			var->transp = (struct fb_bitfield){ .offset = 0,
+							    .length = 0 };
+		} else if (var->bits_per_pixel == 8) {
+			var->red = (struct fb_bitfield){ .offset = 0,
+							 .length = 8 };
+			var->green = var->red;
+			var->blue = var->red;
+			var->transp = (struct fb_bitfield){ .offset = 0,
+							    .length = 0 };
+		}
+
+		var->pixclock = hdmi_var_init.pixclock;
+		var->left_margin = hdmi_var_init.left_margin;
+		var->right_margin = hdmi_var_init.right_margin;
+		var->upper_margin = hdmi_var_init.upper_margin;
+		var->lower_margin = hdmi_var_init.lower_margin;
+		var->hsync_len = hdmi_var_init.hsync_len;
+		var->vsync_len = hdmi_var_init.vsync_len;
+		var->sync = hdmi_var_init.sync;
+
+		// The mode field is used both for interlacing and how the
+		// console should be updated. Only update the interlacing bit.
+		var->vmode = (hdmi_var_init.vmode & FB_VMODE_MASK) |
+			     (var->vmode & ~FB_VMODE_MASK);
+	}
+	return 0;
+}
+
+/*
+ * This function is used to map the framebuffer into the user's address space.
+ * By default, the framebuffer is treated as IO memory, but we want a weak
+ * memory ordering.
+ *
+ * When emulating a lower color depth, we map the shadow buffer instead. That's
+ * ordinary cached memory.
+ */
+static int hdmi_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct hdmi_par *par;
+
+	pr_info("called mmap for %p on %p\n", vma, info);
+	if (WARN_ON(info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	if (info->screen_buffer == (char *)par->shadow)
+		return remap_vmalloc_range(vma, par->shadow, vma->vm_pgoff);
+	return dma_mmap_attrs(info->dev, vma, par->scanout, par->scanout_bus,
+			      HDMI_BUF_LEN, DMA_ATTR_WRITE_COMBINE);
+}
+
+/*
+ * We support VBlanks, and we should try to expose that to user-space. It seems
+ * the way this is usually done is through ioctls, specifically `FBIOGET_VBLANK`
+ * and `FBIO_WAITFORVSYNC`. We implement both. We also have our own for frame
+ * callbacks, which is declared in our header.
+ */
+static int hdmi_ioctl(struct fb_info *info, unsigned int cmd, unsigned long arg)
+{
+	if (WARN_ON(info == NULL))
+		return -EINVAL;
+	hdmi_assert_init(info);
+
+	hdmi_client_account_ioctl(info->par, cmd);
+
+	switch (cmd) {
+	case FBIOGET_VBLANK: {
+		struct fb_vblank ret;
+		struct hdmi_coordinate coord;
+#if 0
+		// This could spam the log since it could be called on every
+		// frame, so we disable it
+		pr_debug("called ioctl(FBIOGET_VBLANK) on %p\n", info);
+#endif
+		memset(&ret, 0, sizeof(ret));
+		ret.flags = FB_VBLANK_HAVE_VBLANK | FB_VBLANK_HAVE_HBLANK |
+			    FB_VBLANK_HAVE_COUNT | FB_VBLANK_HAVE_VCOUNT |
+			    FB_VBLANK_HAVE_HCOUNT | FB_VBLANK_HAVE_VSYNC;
+
+		coord = hdmi_coordinate_read(info);
+		ret.count = coord.fid;
+		ret.vcount = coord.row;
+		ret.hcount = coord.col;
+		if (hdmi_coordinate_is_vblank(coord))
+			ret.flags |= FB_VBLANK_VBLANKING;
+		if (hdmi_coordinate_is_hblank(coord))
+			ret.flags |= FB_VBLANK_HBLANKING;
+		if (hdmi_coordinate_is_vsync(coord))
+			ret.flags |= FB_VBLANK_VSYNCING;
+
+		BUILD_BUG_ON(sizeof(ret) == 0);
+		if (copy_to_user((void __user *)arg, &ret, sizeof(ret)))
+			return -EFAULT;
+		return 0;
+	}
+
+	case FBIO_WAITFORVSYNC: {
+		ktime_t start;
+		u64 wait_ns;
+		int res;
+#if 0
+		// This could spam the log since it could be called on every
+		// frame, so we disable it
+		pr_debug("called ioctl(FBIO_WAITFORVSYNC) on %p\n", info);
+#endif
+		// Each frame is just under 17ms. We give a 20% margin. If we
+		// don't hear back by then, something is wrong.
+		start = ktime_get();
+		res = wait_event_interruptible_timeout(
+			hdmi_vblank_waitq,
+			hdmi_coordinate_is_vblank(hdmi_coordinate_read(info)),
+			msecs_to_jiffies(20));
+		if (res == -ERESTARTSYS)
+			return -EINTR;
+		if (WARN_ON(res == 0))
+			return -ETIMEDOUT;
+
+		wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		hdmi_stats_add(info->par, HDMI_STAT_WAIT_NS, wait_ns);
+		hdmi_client_account_vsync(info->par, wait_ns,
+					  hdmi_coordinate_read(info).fid);
+		return 0;
+	}
+
+	case HDMI_IOCTL_FRAME_CALLBACK: {
+		struct hdmi_frame_callback fcb;
+		u64 start;
+		s64 wake;
+		int res;
+
+		if (copy_from_user(&fcb, (void __user *)arg, sizeof(fcb)))
+			return -EFAULT;
+		wake = hdmi_fcb_present(info->par, &fcb);
+		if (wake < 0)
+			return wake;
+		// Copy out before sleeping, so a signal doesn't lose the
+		// deadline
+		if (copy_to_user((void __user *)arg, &fcb, sizeof(fcb)))
+			return -EFAULT;
+		// The framebuffer core calls us with `info->lock` held. Don't
+		// hold it while sleeping, or every other client stalls behind
+		// us, including other clients waiting on their own callbacks.
+		start = ktime_get_ns();
+		unlock_fb_info(info);
+		res = hdmi_fcb_sleep_until(wake);
+		lock_fb_info(info);
+		hdmi_stats_add(info->par, HDMI_STAT_WAIT_NS,
+			       ktime_get_ns() - start);
+		return res;
+	}
+
+	default: {
+		pr_info("called unsupported ioctl(%u) on %p\n", cmd, info);
+		return -ENOTTY;
+	}
+	}
+}
+
+#ifdef CONFIG_COMPAT
+/*
+ * The framebuffer core only translates its own `ioctl`s for 32-bit user-space
+ * on a 64-bit kernel. Ours all have the same layout either way, so only the
+ * pointer needs converting.
+ */
+static int hdmi_compat_ioctl(struct fb_info *info, unsigned int cmd,
+			     unsigned long arg)
+{
+	return hdmi_ioctl(info, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif /* CONFIG_COMPAT */
+
+/*
+ * There's no hardware to configure, since it only supports one mode. But, we
+ * do have to switch which buffer is exposed to the user when the color depth
+ * changes.
+ *
+ * At 32bpp, the user gets the scanout buffer directly. At lower depths, the
+ * user gets the shadow buffer, and we track damage to it. On every VBlank, the
+ * damaged tiles are expanded into the scanout buffer. See `hdmi_damage_work`.
+ *
+ * We'll also use this opportunity to do an extra test. We should never try to
+ * set the hardware to a state that wouldn't pass `check_var`.
+ */
+static int hdmi_set_par(struct fb_info *info)
+{
+	struct hdmi_par *par;
+	bool expand;
+
+	pr_info("called set_par on %p\n", info);
+	if (WARN_ON(info == NULL))
+		return 1;
+	hdmi_assert_init(info);
+	par = info->par;
+
+#ifdef DEBUG
+	{
+		struct fb_var_screeninfo new_var = info->var;
+		if (hdmi_check_var(&new_var, info) != 0)
+			return 1;
+	}
+#endif /* DEBUG */
+
+	// Nothing can be scanning the buffers while we swap them out
+	mutex_lock(&par->damage_lock);
+	expand = info->var.bits_per_pixel != 32;
+	info->fix.line_length = 640u * info->var.bits_per_pixel / 8u;
+	info->fix.smem_len = info->fix.line_length * 480u;
+	info->fix.visual = info->var.bits_per_pixel == 8 ?
+				   FB_VISUAL_PSEUDOCOLOR :
+				   FB_VISUAL_TRUECOLOR;
+	info->screen_buffer = expand ? (char *)par->shadow :
+				       (char *)par->scanout;
+	info->screen_size = info->fix.smem_len;
+	WRITE_ONCE(par->expand, expand);
+	hdmi_assert_depth(info);
+
+	// Damage detection isn't allowed at 32bpp. The work checks whether
+	// it's active, so anything already queued will do nothing.
+	if (expand)
+		hdmi_damage_start(par);
+	else
+		WRITE_ONCE(par->damage_enabled, false);
+	mutex_unlock(&par->damage_lock);
+
+	// Load the palette from the colormap. The colormap was allocated in the
+	// probe function.
+	if (info->fix.visual == FB_VISUAL_PSEUDOCOLOR)
+		fb_set_cmap(&info->cmap, info);
+
+	pr_info("-> now at %ubpp%s\n", info->var.bits_per_pixel,
+		expand ? " (emulated)" : "");
+	return 0;
+}
+
+/*******************************************************************************
+ * Device Setup and Teardown
+ ******************************************************************************/
+
+/*
+ * Helper function to allocate a `struct fb_info`. It also initializes the
+ * structure with default/template values. This allocation is unmanaged, and
+ * it is the caller's responsibility to release.
+ */
+static int hdmi_probe_create_fbinfo(struct platform_device *pdev,
+				    struct fb_info **info)
+{
+	*info = framebuffer_alloc(sizeof(struct hdmi_par), &pdev->dev);
+	if (*info == NULL) {
+		pr_err("failed to allocate framebuffer device\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * Still need to set:
+	 *   * `.screen_base`
+	 */
+	pr_info("allocated framebuffer device @ %p\n", *info);
+	(*info)->fix = hdmi_fix_init;
+	(*info)->var = hdmi_var_init;
+	(*info)->fbops = &hdmi_fbops;
+	(*info)->screen_size = (*info)->fix.smem_len;
+	return 0;
+}
+
+/*
+ * Helper function to initialize our private data in the `struct fb_info`. The
+ * memory for it was allocated along with the `struct fb_info`.
+ */
+static void hdmi_probe_init_par(struct fb_info *info)
+{
+	struct hdmi_par *par = info->par;
+
+	par->info = info;
+	INIT_LIST_HEAD(&par->clients);
+	mutex_init(&par->clients_lock);
+	par->debugfs = ERR_PTR(-ENODEV);
+	mutex_init(&par->damage_lock);
+	atomic_set(&par->expand_all, 0);
+	INIT_WORK(&par->damage_work, hdmi_damage_work);
+	spin_lock_init(&par->vblank_lock);
+	par->vblank_ns = ktime_get_ns();
+	par->frame_ns = HDMI_FRAME_NS;
+	INIT_DELAYED_WORK(&par->stats_work, hdmi_stats_work);
+	mutex_init(&par->stats_lock);
+	par->stats_prev_ns = ktime_get_ns();
+}
+
+/*
+ * Helper function to map the device registers into our address space. It puts
+ * the virtual address in our private data, and the physical address in the
+ * `mmio_start` field of the framebuffer info.
+ */
+static int hdmi_probe_map_registers(struct platform_device *pdev,
+				    struct fb_info *info)
+{
+	struct resource *res;
+	void __iomem *reg;
+
+	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+	reg = devm_ioremap_resource(&pdev->dev, res);
+	if (IS_ERR(reg)) {
+		pr_err("failed to map registers\n");
+		return PTR_ERR(reg);
+	}
+
+	pr_debug("mapped registers @ %p (phys: %pa)\n", reg, &res->start);
+	((struct hdmi_par *)info->par)->mmio = reg;
+	info->fix.mmio_start = res->start;
+	return 0;
+}
+
+/*
+ * Helper function to allocate the frame buffer in DMA memory. It puts both
+ * the virtual and bus addresses of the buffer into the `struct fb_info`.
+ *
+ * The buffer doesn't have to be physically contiguous in memory, as long as
+ * its contiguous in bus memory. The kernel will use the IOMMU to ensure this,
+ * or it will allocate it contiguously.
+ *
+ * The device only takes a 32-bit bus address, so the buffer has to be
+ * allocated below 4GiB. That's a given on the Zynq 7000, but not on 64-bit
+ * parts.
+ *
+ * Finally, we allow store buffer optimizations on the buffer. Really, we can
+ * go down to a weak memory ordering since it's write only, but that's
+ * actually not implemented on ARM.
+ */
+static int hdmi_probe_alloc_buffer(struct platform_device *pdev,
+				   struct fb_info *info)
+{
+	void *vir_addr;
+	dma_addr_t bus_addr;
+	int res;
+
+	res = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+	if (res != 0) {
+		pr_err("failed to set DMA mask\n");
+		return res;
+	}
+
+	vir_addr = dmam_alloc_attrs(&pdev->dev, HDMI_BUF_LEN, &bus_addr,
+				    GFP_KERNEL, DMA_ATTR_WRITE_COMBINE);
+	if (!vir_addr) {
+		pr_err("failed to allocate buffer\n");
+		return -ENOMEM;
+	}
+
+	pr_debug("allocated buffer @ %p (bus: %pad)\n", vir_addr, &bus_addr);
+	info->screen_base = (void __force *)vir_addr;
+	info->fix.smem_start = bus_addr;
+	((struct hdmi_par *)info->par)->scanout = vir_addr;
+	((struct hdmi_par *)info->par)->scanout_bus = bus_addr;
+	return 0;
+}
+
+static void hdmi_probe_vfree(void *addr)
+{
+	vfree(addr);
+}
+
+/*
+ * Helper function to allocate the shadow buffer used to emulate lower color
+ * depths. It has to be mappable into user space, so it comes from
+ * `vmalloc_user`. There's no managed version of that, so we register our own
+ * action to free it.
+ */
+static int hdmi_probe_alloc_shadow(struct platform_device *pdev,
+				   struct fb_info *info)
+{
+	struct hdmi_par *par = info->par;
+	int res;
+
+	par->shadow = vmalloc_user(HDMI_SHADOW_LEN);
+	if (par->shadow == NULL) {
+		pr_err("failed to allocate shadow buffer\n");
+		return -ENOMEM;
+	}
+	res = devm_add_action_or_reset(&pdev->dev, hdmi_probe_vfree,
+				       par->shadow);
+	if (res != 0) {
+		pr_err("failed to register shadow buffer\n");
+		return res;
+	}
+
+	pr_debug("allocated shadow buffer @ %p\n", par->shadow);
+	return 0;
+}
+
+/*
+ * Helper function to allocate the snapshot used for damage detection. It's
+ * allocated up front, rather than when damage detection starts, so that
+ * changing the color depth can't fail halfway. It's always big enough for the
+ * 32bpp buffer. Like the shadow buffer, it's freed by our own action, which
+ * runs only after the framebuffer is unregistered.
+ */
+static int hdmi_probe_alloc_snapshot(struct platform_device *pdev,
+				     struct fb_info *info)
+{
+	struct hdmi_par *par = info->par;
+	int res;
+
+	par->damage_prev = vmalloc(HDMI_BUF_LEN);
+	if (par->damage_prev == NULL) {
+		pr_err("failed to allocate damage snapshot\n");
+		return -ENOMEM;
+	}
+	res = devm_add_action_or_reset(&pdev->dev, hdmi_probe_vfree,
+				       par->damage_prev);
+	if (res != 0) {
+		pr_err("failed to register damage snapshot\n");
+		return res;
+	}
+
+	pr_debug("allocated damage snapshot @ %p\n", par->damage_prev);
+	return 0;
+}
+
+/*
+ * Helper function to allocate the per-CPU counters for bandwidth and CPU
+ * accounting. The ISR uses these, so they have to be allocated before the
+ * interrupt is requested.
+ */
+static int hdmi_probe_alloc_stats(struct platform_device *pdev,
+				  struct fb_info *info)
+{
+	struct hdmi_par *par = info->par;
+	unsigned cpu;
+
+	par->stats = devm_alloc_percpu(&pdev->dev, struct hdmi_stats);
+	if (par->stats == NULL) {
+		pr_err("failed to allocate statistics\n");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(par->stats, cpu)->syncp);
+
+	pr_debug("allocated statistics @ %p\n", par->stats);
+	return 0;
+}
+
+/*
+ * In true-color mode, the kernel expects us to allocate a pseudo palette. This
+ * maps sixteen colors to their corresponding 32-bit values.
+ */
+static int hdmi_probe_alloc_pseudo_palette(struct platform_device *pdev,
+					   struct fb_info *info)
+{
+	u32 *palette;
+
+	palette = devm_kzalloc(&pdev->dev, 16 * sizeof(u32), GFP_KERNEL);
+	if (!palette) {
+		pr_err("failed to allocate pseudo palette\n");
+		return -ENOMEM;
+	}
+
+	pr_debug("allocated pseudo palette @ %p\n", palette);
+	info->pseudo_palette = palette;
+	return 0;
+}
+
+/*
+ * In pseudo-color mode, the kernel expects the colormap in the
+ * `struct fb_info` to hold the palette. It starts off as the default palette.
+ * This allocation is unmanaged, and it is the caller's responsibility to
+ * release.
+ */
+static int hdmi_probe_alloc_cmap(struct fb_info *info)
+{
+	int res;
+
+	if ((res = fb_alloc_cmap(&info->cmap, 256, 0)) != 0) {
+		pr_err("failed to allocate colormap\n");
+		return res;
+	}
+	pr_debug("allocated colormap\n");
+	return 0;
+}
+
+/*
+ * Helper function to request the IRQ for the device. It registers the function
+ * `hdmi_isr`, and passes it the `struct fb_info` as the cookie. Note that
+ * interrupts will not happen until the device is started.
+ */
+static int hdmi_probe_request_irq(struct platform_device *pdev,
+				  struct fb_info *info)
+{
+	int irq;
+	int res;
+
+	irq = platform_get_irq(pdev, 0);
+	if (irq < 0) {
+		pr_err("failed to get IRQ\n");
+		return irq;
+	}
+
+	res = devm_request_irq(&pdev->dev, irq, hdmi_isr, 0,
+			       "ammrat13-hdmi-dev", info);
+	if (res < 0) {
+		pr_err("failed to request IRQ\n");
+		return res;
+	}
+
+	pr_debug("registered handler for IRQ %d\n", irq);
+	return 0;
+}
+
+/*
+ * Helper function to register the framebuffer device with the kernel. At this
+ * point, the `struct fb_info` MUST be fully initialized.
+ */
+static int hdmi_probe_register_fbinfo(struct fb_info *info)
+{
+	int res;
+	hdmi_assert_init(info);
+
+	if ((res = register_framebuffer(info)) < 0) {
+		pr_err("failed to register framebuffer device\n");
+		return res;
+	}
+	pr_debug("registered framebuffer device\n");
+	return 0;
+}
+
+/*
+ * Helper function to create our files in debugfs. This has to happen after the
+ * framebuffer is registered, since the directory is named after its node.
+ * Failure here isn't fatal, so this doesn't return anything.
+ */
+static void hdmi_probe_create_debugfs(struct fb_info *info)
+{
+	struct hdmi_par *par = info->par;
+	char name[16];
+	hdmi_assert_init(info);
+
+	snprintf(name, sizeof(name), "fb%d", info->node);
+	par->debugfs = debugfs_create_dir(name, hdmi_debugfs_root);
+	debugfs_create_file("clients", 0444, par->debugfs, info,
+			    &hdmi_clients_fops);
+	debugfs_create_file("damage", 0444, par->debugfs, info,
+			    &hdmi_damage_fops);
+	debugfs_create_file("frame_callbacks", 0444, par->debugfs, info,
+			    &hdmi_fcb_fops);
+	pr_debug("created debugfs directory %s\n", name);
+}
+
+static int hdmi_probe(struct platform_device *pdev)
+{
+	struct fb_info *info;
+	struct hdmi_par *par;
+	int res;
+	hdmi_assert_types();
+
+	pr_info("called probe on %p\n", pdev);
+	if (WARN_ON(pdev == NULL))
+		return -EINVAL;
+
+	/*
+	 * The driver data is a `struct fb_info`. The allocation for it is
+	 * unmanaged. This is done for two reasons:
+	 *   1. We need special handling for registration, and that sort of goes
+	 *      hand-in-hand with allocation.
+	 *   2. The `devres` subsystem is built on a stack. If we used the
+	 *      `devres` subsystem, we'd have to allocate this last to prevent
+	 *      the things it references from being freed first.
+	 */
+	if ((res = hdmi_probe_create_fbinfo(pdev, &info)) != 0)
+		goto err;
+	BUG_ON(info == NULL);
+	hdmi_probe_init_par(info);
+	par = info->par;
+
+	/*
+	 * Call all of the initialization functions. These may have dependencies
+	 * on each other, so the order in which we call them matters. If any of
+	 * them fail, make sure to clean up after them.
+	 */
+	if ((res = hdmi_probe_map_registers(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_buffer(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_shadow(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_snapshot(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_stats(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_pseudo_palette(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_alloc_cmap(info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_request_irq(pdev, info)) != 0)
+		goto err;
+	if ((res = hdmi_probe_register_fbinfo(info)) != 0)
+		goto err;
+	hdmi_probe_create_debugfs(info);
+
+	// Tell the device the buffer address. The DMA mask guarantees it fits.
+	hdmi_iowrite32(info, HDMI_BUF_OFF, lower_32_bits(info->fix.smem_start));
+	// Enable interrupts on VBlank
+	hdmi_iowrite32(info, HDMI_GIE_OFF, 0x01ul);
+	hdmi_iowrite32(info, HDMI_IER_OFF, HDMI_VBLANK_IRQ);
+	// Clear the coordinate valid bit from the previous run (if any)
+	hdmi_ioread32(info, HDMI_COORD_CTRL_OFF);
+	// Start the device
+	hdmi_iowrite32(info, HDMI_CTRL_OFF, 0x081ul);
+	// Start computing rates for the accounting
+	queue_delayed_work(hdmi_workqueue, &par->stats_work, HZ);
+
+	dev_set_drvdata(&pdev->dev, info);
+	return 0;
+
+err:
+	// The colormap is safe to free even if it was never allocated
+	if (info != NULL)
+		fb_dealloc_cmap(&info->cmap);
+	framebuffer_release(info);
+	return res;
+}
+
+static int hdmi_remove(struct platform_device *pdev)
+{
+	/*
+	 * When we were probing this device, we did our best to use managed
+	 * resources. This means they will be cleaned up automatically when this
+	 * function returns. We just have to deal with the non-managed
+	 * resources, i.e. the `struct fb_info`.
+	 *
+	 * Also, we know that the device was successfully probed if we made it
+	 * here. The `remove` function is not called on probe failure.
+	 *
+	 * The mainline kernel says that the return value from this function is
+	 * ignored. So, we always return 0. It also means we have to do our own
+	 * error handling if needed.
+	 */
+	struct fb_info *info;
+	struct hdmi_par *par;
+
+	pr_info("called remove on %p\n", pdev);
+	if (WARN_ON(pdev == NULL))
+		return -EINVAL;
+
+	info = dev_get_drvdata(&pdev->dev);
+	hdmi_assert_init(info);
+	par = info->par;
+
+	// First and foremost, stop the device
+	hdmi_iowrite32(info, HDMI_CTRL_OFF, 0x000ul);
+	// Disable interrupts for the next guy
+	hdmi_iowrite32(info, HDMI_GIE_OFF, 0x00ul);
+	hdmi_iowrite32(info, HDMI_IER_OFF, 0x00ul);
+	// Clear the coordinate valid bit from this run. Not strictly necessary,
+	// but just in case.
+	hdmi_ioread32(info, HDMI_COORD_CTRL_OFF);
+	// Note that we keep the buffer address in the device. The next driver should
+	// treat it as garbage, but it will allocate a new one.
+
+	// With interrupts off, nothing new will be queued. Wait for anything
+	// that's already running. Damage detection stays active while we're
+	// emulating a lower color depth, so cancel the work ourselves.
+	hdmi_damage_set_enabled(info, false);
+	cancel_work_sync(&par->damage_work);
+	// This work requeues itself, but cancelling handles that
+	cancel_delayed_work_sync(&par->stats_work);
+
+	// Our debugfs files reference the `struct fb_info`, so they have to go
+	// before it does
+	debugfs_remove_recursive(par->debugfs);
+
+	// The `struct fb_info` is not managed, so we have to free it ourselves. To do
+	// so, we have to unregister then release - one is not enough. The private
+	// data goes with it, but the clients hanging off of it have to be freed
+	// separately.
+	pr_info("freeing framebuffer device @ %p\n", info);
+	unregister_framebuffer(info);
+	hdmi_client_release_all(par);
+	fb_dealloc_cmap(&info->cmap);
+	mutex_destroy(&par->stats_lock);
+	mutex_destroy(&par->clients_lock);
+	mutex_destroy(&par->damage_lock);
+	framebuffer_release(info);
+	par = NULL;
+	// Set all references to the `struct fb_info` to NULL for safety
+	dev_set_drvdata(&pdev->dev, NULL);
+	info = NULL;
+
+	return 0;
+}
+
+/*******************************************************************************
+ * Sysfs Attributes
+ *
+ * These are attached to the platform device, and are created and removed by
+ * the driver core around `probe` and `remove`.
+ ******************************************************************************/
+
+static ssize_t damage_detect_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct hdmi_par *par;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(par->damage_enabled));
+}
+
+static ssize_t damage_detect_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	bool enable;
+	int res;
+	hdmi_assert_init(info);
+
+	if ((res = kstrtobool(buf, &enable)) != 0)
+		return res;
+	if ((res = hdmi_damage_set_enabled(info, enable)) != 0)
+		return res;
+	return count;
+}
+static DEVICE_ATTR_RW(damage_detect);
+
+/*
+ * Bandwidth and CPU accounting. Each counter has a total since the device was
+ * probed, and a rate over the last second. See `hdmi_stats_work`.
+ */
+static u64 hdmi_stat_total(struct device *dev, enum hdmi_stat stat)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	u64 totals[HDMI_STATS];
+	hdmi_assert_init(info);
+
+	hdmi_stats_read(info->par, totals);
+	return totals[stat];
+}
+
+static u64 hdmi_stat_rate(struct device *dev, enum hdmi_stat stat)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct hdmi_par *par;
+	u64 rate;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	mutex_lock(&par->stats_lock);
+	rate = par->stats_rate[stat];
+	mutex_unlock(&par->stats_lock);
+	return rate;
+}
+
+#define HDMI_STAT_ATTRS(name, stat)                                            \
+	static ssize_t name##_show(struct device *dev,                         \
+				   struct device_attribute *attr, char *buf)   \
+	{                                                                      \
+		u64 total = hdmi_stat_total(dev, stat);                        \
+		return sysfs_emit(buf, "%llu\n", total);                       \
+	}                                                                      \
+	static DEVICE_ATTR_RO(name);                                           \
+	static ssize_t name##_per_sec_show(                                    \
+		struct device *dev, struct device_attribute *attr, char *buf)  \
+	{                                                                      \
+		u64 rate = hdmi_stat_rate(dev, stat);                          \
+		return sysfs_emit(buf, "%llu\n", rate);                        \
+	}                                                                      \
+	static DEVICE_ATTR_RO(name##_per_sec)
+
+HDMI_STAT_ATTRS(write_bytes, HDMI_STAT_WRITE_BYTES);
+HDMI_STAT_ATTRS(draw_bytes, HDMI_STAT_DRAW_BYTES);
+HDMI_STAT_ATTRS(kernel_bytes, HDMI_STAT_KERNEL_BYTES);
+HDMI_STAT_ATTRS(isr_ns, HDMI_STAT_ISR_NS);
+HDMI_STAT_ATTRS(wait_ns, HDMI_STAT_WAIT_NS);
+#undef HDMI_STAT_ATTRS
+
+/*
+ * The measured length of a frame. Counting VBlanks over a second is off by up
+ * to one either way, so the refresh rate comes from the frame length the ISR
+ * keeps instead. See `hdmi_fcb_vblank`.
+ */
+static u64 hdmi_stat_frame_ns(struct device *dev)
+{
+	struct fb_info *info = dev_get_drvdata(dev);
+	struct hdmi_par *par;
+	unsigned long flags;
+	u64 period;
+	hdmi_assert_init(info);
+	par = info->par;
+
+	spin_lock_irqsave(&par->vblank_lock, flags);
+	period = par->frame_ns;
+	spin_unlock_irqrestore(&par->vblank_lock, flags);
+	return period;
+}
+
+static ssize_t refresh_mhz_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%llu\n",
+			  div64_u64(1000ull * NSEC_PER_SEC,
+				    hdmi_stat_frame_ns(dev)));
+}
+static DEVICE_ATTR_RO(refresh_mhz);
+
+/*
+ * Scanout reads the whole buffer on every VBlank, so it isn't counted
+ * separately. Its rate is computed from the measured frame length.
+ */
+static ssize_t scanout_bytes_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%llu\n",
+			  hdmi_stat_total(dev, HDMI_STAT_VBLANKS) *
+				  HDMI_BUF_LEN);
+}
+static DEVICE_ATTR_RO(scanout_bytes);
+
+static ssize_t scanout_bytes_per_sec_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	return sysfs_emit(buf, "%llu\n",
+			  div64_u64((u64)HDMI_BUF_LEN * NSEC_PER_SEC,
+				    hdmi_stat_frame_ns(dev)));
+}
+static DEVICE_ATTR_RO(scanout_bytes_per_sec);
+
+static struct attribute *hdmi_attrs[] = {
+	&dev_attr_damage_detect.attr,
+	&dev_attr_refresh_mhz.attr,
+	&dev_attr_scanout_bytes.attr,
+	&dev_attr_scanout_bytes_per_sec.attr,
+	&dev_attr_write_bytes.attr,
+	&dev_attr_write_bytes_per_sec.attr,
+	&dev_attr_draw_bytes.attr,
+	&dev_attr_draw_bytes_per_sec.attr,
+	&dev_attr_kernel_bytes.attr,
+	&dev_attr_kernel_bytes_per_sec.attr,
+	&dev_attr_isr_ns.attr,
+	&dev_attr_isr_ns_per_sec.attr,
+	&dev_attr_wait_ns.attr,
+	&dev_attr_wait_ns_per_sec.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(hdmi);
+
+/*******************************************************************************
+ * Module Registration
+ ******************************************************************************/
+
+static struct of_device_id hdmi_match[] = {
+	// Names for the `.compatible`` field are taken from the final device tree
+	{ .compatible = "xlnx,hdmi-cmd-gen-0.0" },
+	{ .compatible = "xlnx,hdmi-cmd-gen" },
+	{ /* null-terminator */ },
+};
+static struct platform_driver hdmi_driver = {
+    .probe = hdmi_probe,
+    .remove = hdmi_remove,
+    .driver =
+        {
+            .name = "ammrat13-hdmi-dev",
+            .owner = THIS_MODULE,
+            .of_match_table = hdmi_match,
+            .dev_groups = hdmi_groups,
+        },
+};
+
+/*
+ * We can't use `module_platform_driver` since we have a debugfs directory and a
+ * workqueue that have to outlive all the devices.
+ */
+static int __init hdmi_init(void)
+{
+	int res;
+
+	hdmi_workqueue = alloc_workqueue("ammrat13-hdmi-dev",
+					 WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (hdmi_workqueue == NULL) {
+		pr_err("failed to allocate workqueue\n");
+		return -ENOMEM;
+	}
+	hdmi_debugfs_root = debugfs_create_dir("ammrat13-hdmi-dev", NULL);
+	if ((res = platform_driver_register(&hdmi_driver)) != 0) {
+		debugfs_remove_recursive(hdmi_debugfs_root);
+		destroy_workqueue(hdmi_workqueue);
+		return res;
+	}
+	return 0;
+}
+module_init(hdmi_init);
+
+static void __exit hdmi_exit(void)
+{
+	platform_driver_unregister(&hdmi_driver);
+	debugfs_remove_recursive(hdmi_debugfs_root);
+	destroy_workqueue(hdmi_workqueue);
+}
+module_exit(hdmi_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR("Ammar Ratnani <ammrat13@gmail.com>");
+MODULE_DESCRIPTION("Kernel module to drive ammrat13's HDMI Peripheral");
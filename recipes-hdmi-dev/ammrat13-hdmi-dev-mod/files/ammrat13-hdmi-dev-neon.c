@@ -0,0 +1,88 @@
+/*
+ * NEON routines for the HDMI Peripheral driver. This file is compiled with NEON
+ * enabled, so the compiler is free to use the NEON registers anywhere in it.
+ * Everything here MUST only be called between `kernel_neon_begin` and
+ * `kernel_neon_end`.
+ */
+
+#include <linux/string.h>
+#include <linux/types.h>
+
+#ifdef CONFIG_ARM64
+#include <asm/neon-intrinsics.h>
+#else
+#include <arm_neon.h>
+#endif
+
+#include "ammrat13-hdmi-dev-neon.h"
+
+bool hdmi_neon_tile_sync(const u8 *cur, u8 *prev, size_t stride, size_t len,
+			 unsigned lines)
+{
+	unsigned line;
+	size_t i;
+
+	for (line = 0; line < lines; line++) {
+		const u8 *c = cur + line * stride;
+		const u8 *p = prev + line * stride;
+		uint8x16_t acc = vdupq_n_u8(0);
+		uint64x2_t acc64;
+
+		// Accumulate the XOR of the two lines, four registers at a time.
+		// We only check the result once per line since the check is
+		// relatively expensive.
+		for (i = 0; i < len; i += 64) {
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(c + i + 0),
+						     vld1q_u8(p + i + 0)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(c + i + 16),
+						     vld1q_u8(p + i + 16)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(c + i + 32),
+						     vld1q_u8(p + i + 32)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(c + i + 48),
+						     vld1q_u8(p + i + 48)));
+		}
+
+		acc64 = vreinterpretq_u64_u8(acc);
+		if ((vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1)) != 0)
+			goto differs;
+	}
+	return false;
+
+differs:
+	for (; line < lines; line++)
+		memcpy(prev + line * stride, cur + line * stride, len);
+	return true;
+}
+
+void hdmi_neon_expand_rgb565(const u8 *src, size_t src_stride, u8 *dst,
+			     size_t dst_stride, unsigned width, unsigned lines)
+{
+	unsigned line;
+	unsigned i;
+
+	for (line = 0; line < lines; line++) {
+		const u16 *s = (const u16 *)(src + line * src_stride);
+		u8 *d = dst + line * dst_stride;
+
+		for (i = 0; i < width; i += 8) {
+			uint16x8_t px = vld1q_u16(s + i);
+			uint8x8_t r = vmovn_u16(vshrq_n_u16(px, 8));
+			uint8x8_t g = vmovn_u16(vshrq_n_u16(px, 3));
+			uint8x8_t b = vmovn_u16(vshlq_n_u16(px, 3));
+			uint8x8x4_t out;
+
+			// Each channel is now in the top bits of its byte, with
+			// junk below it. Clear the junk, then fill the low bits
+			// with the top bits.
+			r = vand_u8(r, vdup_n_u8(0xf8));
+			g = vand_u8(g, vdup_n_u8(0xfc));
+			out.val[0] = vorr_u8(b, vshr_n_u8(b, 5));
+			out.val[1] = vorr_u8(g, vshr_n_u8(g, 6));
+			out.val[2] = vorr_u8(r, vshr_n_u8(r, 5));
+			out.val[3] = vdup_n_u8(0);
+			// Memory order is B, G, R, X, which is XRGB8888 on a
+			// little-endian machine
+			vst4_u8(d + i * 4, out);
+		}
+	}
+}
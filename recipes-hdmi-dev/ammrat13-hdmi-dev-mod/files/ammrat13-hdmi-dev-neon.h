@@ -0,0 +1,38 @@
+#ifndef AMMRAT13_HDMI_DEV_NEON_H
+#define AMMRAT13_HDMI_DEV_NEON_H
+
+#include <linux/types.h>
+
+/*
+ * Routines that use NEON. They are built in a separate object with NEON
+ * enabled, and they MUST only be called between `kernel_neon_begin` and
+ * `kernel_neon_end`. They are only available with `CONFIG_KERNEL_MODE_NEON`.
+ */
+#ifdef CONFIG_KERNEL_MODE_NEON
+
+/*
+ * Compare a tile of `cur` against the same tile of `prev`, and bring `prev` up
+ * to date if they differ. The tile is `lines` lines of `len` bytes each, with
+ * successive lines `stride` bytes apart. The length MUST be a multiple of 64
+ * bytes, and both pointers MUST be 16-byte aligned.
+ *
+ * The comparison stops at the first line that differs. Lines before that are
+ * already equal, so only the lines from there on are copied.
+ *
+ * Returns whether the tile differed.
+ */
+bool hdmi_neon_tile_sync(const u8 *cur, u8 *prev, size_t stride, size_t len,
+			 unsigned lines);
+
+/*
+ * Expand a tile of RGB565 pixels in `src` to XRGB8888 pixels in `dst`. The tile
+ * is `lines` lines of `width` pixels each, and the strides are in bytes. The
+ * width MUST be a multiple of 8. The low bits of each expanded channel are
+ * filled by replicating its high bits, so full intensity stays full intensity.
+ */
+void hdmi_neon_expand_rgb565(const u8 *src, size_t src_stride, u8 *dst,
+			     size_t dst_stride, unsigned width, unsigned lines);
+
+#endif /* CONFIG_KERNEL_MODE_NEON */
+
+#endif /* AMMRAT13_HDMI_DEV_NEON_H */
@@ -0,0 +1,39 @@
+#ifndef AMMRAT13_HDMI_DEV_H
+#define AMMRAT13_HDMI_DEV_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Driver-specific `ioctl`s for the HDMI Peripheral. This header is shared with
+ * user-space, so it can only use UAPI types.
+ */
+
+/*
+ * Argument to `HDMI_IOCTL_FRAME_CALLBACK`. All times are in nanoseconds, and
+ * absolute times are on `CLOCK_MONOTONIC`.
+ */
+struct hdmi_frame_callback {
+	/*
+	 * In: how long the client took to render the frame it's presenting
+	 * now, or zero if it isn't presenting anything
+	 */
+	__u64 render_ns;
+	/* Out: how long the driver expects the next frame to take to render */
+	__u64 predict_ns;
+	/* Out: when the VBlank the next frame has to be ready by starts */
+	__u64 deadline_ns;
+};
+
+/*
+ * Present a frame, then sleep until it's time to render the next one. The
+ * driver learns how long the client takes to render from `render_ns`, and
+ * wakes it just early enough to finish before the next VBlank. Returns `0` on
+ * success, `EINTR` if a signal interrupted the sleep, or `ENOMEM` if the
+ * driver couldn't allocate its per-process state. That state is created on
+ * first use, so processes that inherited the file can use this too.
+ */
+#define HDMI_IOCTL_FRAME_CALLBACK \
+	_IOWR('F', 0xa0, struct hdmi_frame_callback)
+
+#endif /* AMMRAT13_HDMI_DEV_H */
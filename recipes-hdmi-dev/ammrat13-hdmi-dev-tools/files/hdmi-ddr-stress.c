@@ -0,0 +1,468 @@
+/*
+ * DDR contention benchmark for the HDMI Peripheral. The peripheral fetches its
+ * buffer from DDR, and it competes for bandwidth with the CPUs and with any PL
+ * accelerators. This tool ramps up synthetic memory traffic while watching the
+ * display's timing, and reports the bandwidth at which the timing degrades.
+ * Use it as:
+ *
+ *   hdmi-ddr-stress [-d /dev/fbN] [-s STEPS] [-t SECONDS] [-e BUDGET]
+ *                   [-m MIN_BAD] [-l LATE_ROWS] [-D]
+ *
+ * The load is generated by one streaming-copy thread per online CPU. First, we
+ * calibrate by running the threads flat out to find the peak copy bandwidth.
+ * Then, we step the load from zero up to that peak in `STEPS` equal steps,
+ * holding each for `SECONDS`. With `-D`, the kernel's `dmatest` module is also
+ * run for the whole benchmark, so dmaengine traffic is added to every step.
+ *
+ * While the load runs, a sampler thread waits on every VBlank and checks:
+ *   * frame ID gaps: the frame ID advanced by more than one between samples,
+ *   * late wakeups: we woke up at least `LATE_ROWS` lines into the frame (by
+ *     default, half of VBlank), or outside of VBlank entirely, which is a proxy
+ *     for the latency of the driver's ISR, and
+ *   * coordinate irregularities: coordinates that are out of range.
+ * A step is degraded if the fraction of bad frames exceeds that of the unloaded
+ * step by more than `BUDGET`, and if it saw at least `MIN_BAD` bad frames. A
+ * five second step is only 300 frames, so a single late wakeup is already a
+ * third of a percent. The default budget is a percent, and the default minimum
+ * is five frames, so that one unlucky wakeup doesn't end the benchmark early.
+ * The headroom is the copy bandwidth of the last step before the first
+ * degraded one.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+
+/*
+ * Timing of the only mode the hardware supports. See `hdmi_var_init` and the
+ * coordinate helpers in the driver.
+ */
+#define HDMI_ROWS 525u
+#define HDMI_COLS 800u
+#define HDMI_VBLANK_ROWS 45u
+#define HDMI_LINE_NS 31778u
+#define HDMI_FID_MOD 4096u
+
+/*
+ * Each load thread copies between two buffers of this size. It's much larger
+ * than the L2 cache, so the copies actually go out to DDR.
+ */
+#define LOAD_BUF_LEN (16ul << 20)
+#define LOAD_CHUNK_LEN (64ul << 10)
+
+#define DMATEST_PARAMS "/sys/module/dmatest/parameters/"
+
+/*******************************************************************************
+ * Load Generation
+ ******************************************************************************/
+
+struct load_thread {
+	pthread_t thread;
+	int cpu;
+	unsigned char *src;
+	unsigned char *dst;
+};
+
+/*
+ * Target bandwidth for each load thread, in bytes per second. Zero means idle,
+ * and `UINT64_MAX` means flat out.
+ */
+static _Atomic uint64_t load_target_bps;
+static _Atomic uint64_t load_bytes;
+static _Atomic bool load_stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(ns / 1000000000ull);
+	ts.tv_nsec = (long)(ns % 1000000000ull);
+	nanosleep(&ts, NULL);
+}
+
+static void pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * Copy in chunks, and after each chunk, sleep off however far ahead of the
+ * target rate we are. The schedule restarts whenever the target changes.
+ */
+static void *load_main(void *cookie)
+{
+	struct load_thread *lt = cookie;
+	uint64_t target = 0;
+	uint64_t epoch = 0;
+	uint64_t done = 0;
+	size_t off = 0;
+
+	pin_to_cpu(lt->cpu);
+	while (!atomic_load(&load_stop)) {
+		uint64_t want = atomic_load(&load_target_bps);
+		uint64_t due;
+		uint64_t now;
+
+		if (want != target) {
+			target = want;
+			epoch = now_ns();
+			done = 0;
+		}
+		if (target == 0) {
+			sleep_ns(1000000ull);
+			continue;
+		}
+
+		memcpy(lt->dst + off, lt->src + off, LOAD_CHUNK_LEN);
+		off = (off + LOAD_CHUNK_LEN) % LOAD_BUF_LEN;
+		done += LOAD_CHUNK_LEN;
+		atomic_fetch_add(&load_bytes, LOAD_CHUNK_LEN);
+
+		if (target != UINT64_MAX) {
+			due = epoch + done * 1000000000ull / target;
+			now = now_ns();
+			if (due > now)
+				sleep_ns(due - now);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Use the kernel's `dmatest` module as a dmaengine load. It has no rate
+ * control, so it just runs for the whole benchmark.
+ */
+static bool dmatest_set(const char *param, const char *val)
+{
+	char path[128];
+	FILE *f;
+	bool ok;
+
+	snprintf(path, sizeof(path), DMATEST_PARAMS "%s", param);
+	f = fopen(path, "w");
+	if (f == NULL)
+		return false;
+	ok = fputs(val, f) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+static bool dmatest_start(void)
+{
+	return dmatest_set("iterations", "0") &&
+	       dmatest_set("noverify", "Y") && dmatest_set("norandom", "Y") &&
+	       dmatest_set("channel", "") && dmatest_set("run", "1");
+}
+
+static void dmatest_stop(void)
+{
+	dmatest_set("run", "0");
+}
+
+/*******************************************************************************
+ * Display Sampling
+ ******************************************************************************/
+
+struct sample_stats {
+	uint64_t frames;
+	uint64_t fid_gaps;
+	uint64_t late;
+	uint64_t irregular;
+	uint64_t wake_ns_sum;
+	uint64_t wake_ns_max;
+};
+
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sample_stats sample_cur;
+static unsigned sample_late_rows = HDMI_VBLANK_ROWS / 2u;
+
+static void *sample_main(void *cookie)
+{
+	int fd = *(int *)cookie;
+	struct sched_param sp = { .sched_priority = 50 };
+	uint32_t prev_fid = 0;
+	bool have_prev = false;
+
+	// We want to measure the display, not the scheduler, so try to make
+	// sure we run as soon as we're woken
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0)
+		fprintf(stderr, "warning: could not get SCHED_FIFO, wakeup "
+				"latencies will include scheduling delay\n");
+
+	while (!atomic_load(&load_stop)) {
+		struct fb_vblank vbl;
+		uint32_t arg = 0;
+		uint64_t wake;
+
+		if (ioctl(fd, FBIO_WAITFORVSYNC, &arg) != 0 ||
+		    ioctl(fd, FBIOGET_VBLANK, &vbl) != 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ioctl failed");
+			exit(1);
+		}
+
+		// The wait returns immediately if we're still in the same
+		// VBlank, so skip until we see a new frame
+		if (have_prev && vbl.count == prev_fid) {
+			sleep_ns((uint64_t)HDMI_VBLANK_ROWS * HDMI_LINE_NS);
+			continue;
+		}
+
+		wake = (uint64_t)vbl.vcount * HDMI_LINE_NS;
+		pthread_mutex_lock(&sample_lock);
+		sample_cur.frames++;
+		sample_cur.wake_ns_sum += wake;
+		if (wake > sample_cur.wake_ns_max)
+			sample_cur.wake_ns_max = wake;
+		if (have_prev && (vbl.count - prev_fid) % HDMI_FID_MOD != 1u)
+			sample_cur.fid_gaps++;
+		if (vbl.vcount >= HDMI_ROWS || vbl.hcount >= HDMI_COLS)
+			sample_cur.irregular++;
+		else if ((vbl.flags & FB_VBLANK_VBLANKING) == 0 ||
+			 vbl.vcount >= sample_late_rows)
+			sample_cur.late++;
+		pthread_mutex_unlock(&sample_lock);
+
+		prev_fid = vbl.count;
+		have_prev = true;
+	}
+	return NULL;
+}
+
+static uint64_t bad_count(const struct sample_stats *s)
+{
+	return s->fid_gaps + s->late + s->irregular;
+}
+
+static double bad_fraction(const struct sample_stats *s)
+{
+	if (s->frames == 0)
+		return 1.0;
+	return (double)bad_count(s) / (double)s->frames;
+}
+
+/*
+ * Whether a step is degraded relative to the unloaded step. Both conditions
+ * have to hold: the fraction alone is too noisy over a few hundred frames, and
+ * the count alone doesn't scale with the length of the step.
+ */
+static bool is_degraded(const struct sample_stats *s,
+			const struct sample_stats *base, double budget,
+			uint64_t min_bad)
+{
+	// A step with no frames at all means the display stalled outright
+	if (s->frames == 0)
+		return true;
+	return bad_count(s) >= min_bad &&
+	       bad_fraction(s) > bad_fraction(base) + budget;
+}
+
+/*******************************************************************************
+ * Driver
+ ******************************************************************************/
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-d /dev/fbN] [-s STEPS] [-t SECONDS] [-e BUDGET] "
+		"[-m MIN_BAD] [-l LATE_ROWS] [-D]\n",
+		argv0);
+	exit(2);
+}
+
+/*
+ * Run the load at the given target for the given time, and return the copy
+ * bandwidth actually achieved along with the display statistics.
+ */
+static double run_step(uint64_t target_bps, unsigned secs,
+		       struct sample_stats *stats)
+{
+	uint64_t start_bytes;
+	uint64_t start;
+	uint64_t end;
+
+	atomic_store(&load_target_bps, target_bps);
+	// Give the threads a moment to settle on the new rate
+	sleep_ns(100000000ull);
+
+	pthread_mutex_lock(&sample_lock);
+	memset(&sample_cur, 0, sizeof(sample_cur));
+	pthread_mutex_unlock(&sample_lock);
+	start_bytes = atomic_load(&load_bytes);
+	start = now_ns();
+
+	sleep_ns((uint64_t)secs * 1000000000ull);
+
+	end = now_ns();
+	pthread_mutex_lock(&sample_lock);
+	*stats = sample_cur;
+	pthread_mutex_unlock(&sample_lock);
+	// A copy reads and writes, so it moves twice the bytes through DDR
+	return 2.0 * (double)(atomic_load(&load_bytes) - start_bytes) /
+	       ((double)(end - start) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/fb0";
+	unsigned steps = 10;
+	unsigned secs = 5;
+	double budget = 0.01;
+	uint64_t min_bad = 5;
+	bool use_dmatest = false;
+	struct load_thread *threads;
+	pthread_t sampler;
+	struct sample_stats stats;
+	struct sample_stats base;
+	double peak_bps;
+	double headroom_bps = 0.0;
+	bool degraded = false;
+	int ncpus;
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "d:s:t:e:m:l:D")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 's':
+			steps = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			secs = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			budget = strtod(optarg, NULL);
+			break;
+		case 'm':
+			min_bad = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			sample_late_rows = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			use_dmatest = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || steps == 0 || secs == 0)
+		usage(argv[0]);
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror("failed to open framebuffer");
+		return 1;
+	}
+
+	ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+	threads = calloc((size_t)ncpus, sizeof(*threads));
+	if (threads == NULL) {
+		perror("failed to allocate threads");
+		return 1;
+	}
+	for (i = 0; i < ncpus; i++) {
+		threads[i].cpu = i;
+		threads[i].src = malloc(LOAD_BUF_LEN);
+		threads[i].dst = malloc(LOAD_BUF_LEN);
+		if (threads[i].src == NULL || threads[i].dst == NULL) {
+			perror("failed to allocate load buffers");
+			return 1;
+		}
+		// Fault everything in up front
+		memset(threads[i].src, 0xa5, LOAD_BUF_LEN);
+		memset(threads[i].dst, 0x5a, LOAD_BUF_LEN);
+		pthread_create(&threads[i].thread, NULL, load_main,
+			       &threads[i]);
+	}
+	pthread_create(&sampler, NULL, sample_main, &fd);
+
+	if (use_dmatest && !dmatest_start()) {
+		fprintf(stderr, "failed to start dmatest, is it loaded?\n");
+		use_dmatest = false;
+	}
+
+	printf("calibrating with %d load threads%s...\n", ncpus,
+	       use_dmatest ? " and dmatest" : "");
+	peak_bps = run_step(UINT64_MAX, secs, &stats);
+	printf("peak copy bandwidth: %.1f MB/s\n\n", peak_bps / 1e6);
+
+	printf("%5s %10s %8s %8s %8s %8s %10s %10s\n", "step", "MB/s", "frames",
+	       "fidgaps", "late", "irreg", "wake(us)", "maxwake");
+	for (i = 0; i <= (int)steps; i++) {
+		// Split the step's target evenly among the threads, and
+		// remember that each copied byte is two bytes of traffic
+		uint64_t target =
+			(uint64_t)(peak_bps * i / steps / 2.0 / ncpus);
+		double bps = run_step(i == 0 ? 0 : target, secs, &stats);
+		bool bad;
+
+		if (i == 0)
+			base = stats;
+		bad = !degraded && is_degraded(&stats, &base, budget, min_bad);
+		printf("%4u%% %10.1f %8llu %8llu %8llu %8llu %10.1f %10.1f%s\n",
+		       100u * i / steps, bps / 1e6,
+		       (unsigned long long)stats.frames,
+		       (unsigned long long)stats.fid_gaps,
+		       (unsigned long long)stats.late,
+		       (unsigned long long)stats.irregular,
+		       stats.frames ? (double)stats.wake_ns_sum /
+					      (double)stats.frames / 1e3 :
+				      0.0,
+		       (double)stats.wake_ns_max / 1e3,
+		       bad ? "  <- degraded" : "");
+
+		if (bad)
+			degraded = true;
+		else if (!degraded)
+			headroom_bps = bps;
+	}
+
+	atomic_store(&load_stop, true);
+	if (use_dmatest)
+		dmatest_stop();
+	for (i = 0; i < ncpus; i++)
+		pthread_join(threads[i].thread, NULL);
+	pthread_join(sampler, NULL);
+
+	printf("\n");
+	if (degraded)
+		printf("display timing degrades above %.1f MB/s of CPU copy "
+		       "traffic%s\n",
+		       headroom_bps / 1e6,
+		       use_dmatest ? " (plus dmatest)" : "");
+	else
+		printf("display timing held up to the peak of %.1f MB/s%s\n",
+		       headroom_bps / 1e6,
+		       use_dmatest ? " (plus dmatest)" : "");
+	return 0;
+}
@@ -0,0 +1,595 @@
+/*
+ * Display workload recorder for the HDMI Peripheral. This is an `LD_PRELOAD`
+ * shim that sits between an application and the framebuffer driver, and logs
+ * what the application does to a trace file. Use it as:
+ *
+ *   HDMI_TRACE_FILE=app.trace LD_PRELOAD=libhdmi-trace.so ./app
+ *
+ * The following environment variables are consulted:
+ *   * `HDMI_TRACE_FILE`: where to write the trace (default: `hdmi.trace`). Any
+ *     `%p` in it is replaced with the process ID.
+ *   * `HDMI_TRACE_FRAMES`: set to `0` to skip capturing the contents of the
+ *     mmapped buffer, and only log timing
+ *
+ * Note that capturing frames requires reading the whole mmapped buffer on every
+ * frame boundary. The buffer is write-combined, so this is slow, and it will
+ * perturb the application's timing. The per-call timing in the trace does not
+ * include the time we spend capturing.
+ *
+ * The color depth is read from the driver when the trace is opened, and again
+ * whenever the application calls `FBIOPUT_VSCREENINFO`. Changes made by other
+ * processes, like `fbset`, aren't seen. Neither is the 8bpp palette.
+ *
+ * The trace file is only opened once the process first touches a framebuffer.
+ * That way, launcher scripts and other processes that inherit `LD_PRELOAD`
+ * without using the framebuffer don't clobber the trace. Once a process starts
+ * tracing, it removes the shim from `LD_PRELOAD` so the processes it spawns
+ * aren't traced, and children it forks stop tracing.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+#include <linux/major.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "hdmi-trace.h"
+
+/*******************************************************************************
+ * State
+ ******************************************************************************/
+
+/*
+ * We classify file descriptors lazily, the first time we see them, and cache
+ * the result. Descriptors past the end of the table are classified on every
+ * call.
+ */
+enum hdmi_fd_kind {
+	HDMI_FD_UNKNOWN = 0,
+	HDMI_FD_FB,
+	HDMI_FD_OTHER,
+};
+#define HDMI_FD_TABLE_LEN 1024
+static unsigned char hdmi_fd_table[HDMI_FD_TABLE_LEN];
+
+/*
+ * The application's mapping of the framebuffer, if any. We only track one,
+ * since there is only one framebuffer to map.
+ */
+static const unsigned char *hdmi_map_addr;
+static size_t hdmi_map_len;
+
+static FILE *hdmi_trace_file;
+static bool hdmi_trace_opened;
+static bool hdmi_trace_frames;
+static uint64_t hdmi_trace_start_ns;
+static uint64_t hdmi_line_hash[HDMI_TRACE_YRES];
+static bool hdmi_have_keyframe;
+
+/*
+ * The current color depth and line length, as last read from the driver. The
+ * line length is what frames are captured in units of.
+ */
+static uint32_t hdmi_bpp;
+static uint32_t hdmi_line_len;
+
+/*
+ * The frame ID at the last frame boundary, so applications that pace
+ * themselves by polling `FBIOGET_VBLANK` get their frames captured too.
+ */
+static uint32_t hdmi_last_fid;
+static bool hdmi_have_fid;
+
+/*
+ * Everything above is protected by this lock. Also, we set the thread-local
+ * flag while we're inside the shim so that any calls we make ourselves don't
+ * get recorded.
+ */
+static pthread_mutex_t hdmi_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool hdmi_in_shim;
+
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_close)(int);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static void *(*real_mmap64)(void *, size_t, int, int, int, off64_t);
+static int (*real_munmap)(void *, size_t);
+
+/*******************************************************************************
+ * Helper Functions
+ ******************************************************************************/
+
+static uint64_t hdmi_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * FNV-1a over a line. Collisions would only cost us a missed dirty line in the
+ * trace, so a fast non-cryptographic hash is fine.
+ */
+static uint64_t hdmi_hash_line(const unsigned char *line, size_t len)
+{
+	const uint64_t *words = (const uint64_t *)line;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+	for (i = 0; i < len / sizeof(uint64_t); i++) {
+		hash ^= words[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/*
+ * Read the color depth and line length from the driver. Returns false if
+ * either can't be read, or if they're not something we can record.
+ */
+static bool hdmi_read_mode(int fd, uint32_t *bpp, uint32_t *line_len)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	if (real_ioctl(fd, FBIOGET_VSCREENINFO, &var) != 0 ||
+	    real_ioctl(fd, FBIOGET_FSCREENINFO, &fix) != 0)
+		return false;
+	if (fix.line_length == 0 || fix.line_length % sizeof(uint64_t) != 0 ||
+	    fix.line_length > HDMI_TRACE_MAX_LINE_LEN)
+		return false;
+	*bpp = var.bits_per_pixel;
+	*line_len = fix.line_length;
+	return true;
+}
+
+static void hdmi_trace_open(int fd);
+
+static bool hdmi_fd_is_fb(int fd)
+{
+	struct stat st;
+	bool ret;
+
+	if (fd < 0)
+		return false;
+	if (fd < HDMI_FD_TABLE_LEN && hdmi_fd_table[fd] != HDMI_FD_UNKNOWN)
+		return hdmi_fd_table[fd] == HDMI_FD_FB;
+
+	ret = fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+	      major(st.st_rdev) == FB_MAJOR;
+	if (fd < HDMI_FD_TABLE_LEN)
+		hdmi_fd_table[fd] = ret ? HDMI_FD_FB : HDMI_FD_OTHER;
+	if (ret)
+		hdmi_trace_open(fd);
+	return ret;
+}
+
+/*
+ * Append a record to the trace. The caller MUST hold the lock. Errors are
+ * reported once, after which we stop recording.
+ */
+static void hdmi_emit(uint16_t type, uint64_t when_ns, uint32_t arg0,
+		      uint32_t arg1, const void *payload, uint32_t len)
+{
+	struct hdmi_trace_record rec;
+
+	if (hdmi_trace_file == NULL)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.len = len;
+	rec.time_ns = when_ns - hdmi_trace_start_ns;
+	rec.arg0 = arg0;
+	rec.arg1 = arg1;
+	if (fwrite(&rec, sizeof(rec), 1, hdmi_trace_file) != 1 ||
+	    (len != 0 && fwrite(payload, len, 1, hdmi_trace_file) != 1)) {
+		fprintf(stderr, "hdmi-trace: failed to write trace: %s\n",
+			strerror(errno));
+		fclose(hdmi_trace_file);
+		hdmi_trace_file = NULL;
+	}
+}
+
+/*
+ * Snapshot the mmapped buffer as a frame record. Only the lines whose hash
+ * changed since the last snapshot are stored. The caller MUST hold the lock.
+ */
+static void hdmi_emit_frame(uint64_t when_ns)
+{
+	static unsigned char
+		payload[HDMI_TRACE_LINEMAP_LEN + HDMI_TRACE_MAX_BUF_LEN];
+	unsigned char *data;
+	uint64_t hash;
+	uint32_t dirty;
+	size_t lines;
+	size_t i;
+
+	if (!hdmi_trace_frames || hdmi_map_addr == NULL || hdmi_line_len == 0)
+		return;
+
+	lines = hdmi_map_len / hdmi_line_len;
+	if (lines > HDMI_TRACE_YRES)
+		lines = HDMI_TRACE_YRES;
+
+	memset(payload, 0, HDMI_TRACE_LINEMAP_LEN);
+	data = payload + HDMI_TRACE_LINEMAP_LEN;
+	dirty = 0;
+	for (i = 0; i < lines; i++) {
+		const unsigned char *line = hdmi_map_addr + i * hdmi_line_len;
+		// Copy out first so we hash exactly what we store, even if the
+		// application is writing concurrently
+		memcpy(data, line, hdmi_line_len);
+		hash = hdmi_hash_line(data, hdmi_line_len);
+		if (hdmi_have_keyframe && hash == hdmi_line_hash[i])
+			continue;
+		hdmi_line_hash[i] = hash;
+		payload[i / 8] |= 1u << (i % 8);
+		data += hdmi_line_len;
+		dirty++;
+	}
+	hdmi_have_keyframe = true;
+
+	if (dirty != 0)
+		hdmi_emit(HDMI_TRACE_FRAME, when_ns, dirty, 0, payload,
+			  (uint32_t)(data - payload));
+}
+
+/*******************************************************************************
+ * Setup and Teardown
+ ******************************************************************************/
+
+/*
+ * Expand `%p` in the trace path to our process ID. Returns false if the result
+ * doesn't fit.
+ */
+static bool hdmi_trace_path(char *out, size_t len, const char *path)
+{
+	size_t n = 0;
+	int res;
+
+	for (; *path != '\0'; path++) {
+		if (path[0] == '%' && path[1] == 'p') {
+			res = snprintf(out + n, len - n, "%ld", (long)getpid());
+			if (res < 0 || (size_t)res >= len - n)
+				return false;
+			n += (size_t)res;
+			path++;
+			continue;
+		}
+		if (n + 1 >= len)
+			return false;
+		out[n++] = *path;
+	}
+	out[n] = '\0';
+	return true;
+}
+
+/*
+ * Remove ourselves from `LD_PRELOAD`, keeping anything else that's in it.
+ */
+static void hdmi_trace_unpreload(void)
+{
+	const char *preload = getenv("LD_PRELOAD");
+	char *copy;
+	char *rest;
+	char *tok;
+	size_t n = 0;
+
+	if (preload == NULL)
+		return;
+	copy = strdup(preload);
+	rest = strdup(preload);
+	if (copy == NULL || rest == NULL) {
+		free(copy);
+		free(rest);
+		return;
+	}
+	rest[0] = '\0';
+	for (tok = strtok(copy, " :"); tok != NULL; tok = strtok(NULL, " :")) {
+		if (strstr(tok, "libhdmi-trace.so") != NULL)
+			continue;
+		n += (size_t)sprintf(rest + n, "%s%s", n == 0 ? "" : ":", tok);
+	}
+	if (n == 0)
+		unsetenv("LD_PRELOAD");
+	else
+		setenv("LD_PRELOAD", rest, 1);
+	free(copy);
+	free(rest);
+}
+
+/*
+ * A child we fork shares our trace file. If it kept writing, its records would
+ * be interleaved with ours, so it stops tracing. The `FILE` is dropped without
+ * closing it, since that would flush our buffered records a second time.
+ */
+static void hdmi_trace_atfork_child(void)
+{
+	hdmi_trace_file = NULL;
+	hdmi_trace_opened = true;
+	hdmi_map_addr = NULL;
+	hdmi_map_len = 0;
+	hdmi_have_fid = false;
+}
+
+/*
+ * Open the trace file and write its header. This is called the first time we
+ * see a framebuffer, and only does anything the first time it's called.
+ */
+static void hdmi_trace_open(int fd)
+{
+	struct hdmi_trace_header hdr;
+	const char *path;
+	char buf[4096];
+
+	pthread_mutex_lock(&hdmi_lock);
+	if (hdmi_trace_opened)
+		goto out;
+	hdmi_trace_opened = true;
+
+	if (!hdmi_read_mode(fd, &hdmi_bpp, &hdmi_line_len)) {
+		fprintf(stderr, "hdmi-trace: failed to read the color depth\n");
+		goto out;
+	}
+
+	path = getenv("HDMI_TRACE_FILE");
+	if (path == NULL || *path == '\0')
+		path = "hdmi.trace";
+	if (!hdmi_trace_path(buf, sizeof(buf), path)) {
+		fprintf(stderr, "hdmi-trace: trace path too long: %s\n", path);
+		goto out;
+	}
+	hdmi_trace_unpreload();
+
+	hdmi_trace_file = fopen(buf, "wb");
+	if (hdmi_trace_file == NULL) {
+		fprintf(stderr, "hdmi-trace: failed to open %s: %s\n", buf,
+			strerror(errno));
+		goto out;
+	}
+
+	hdmi_trace_start_ns = hdmi_now_ns();
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HDMI_TRACE_MAGIC;
+	hdr.version = HDMI_TRACE_VERSION;
+	hdr.xres = HDMI_TRACE_XRES;
+	hdr.yres = HDMI_TRACE_YRES;
+	hdr.line_length = hdmi_line_len;
+	hdr.bits_per_pixel = hdmi_bpp;
+	hdr.start_ns = hdmi_trace_start_ns;
+	if (fwrite(&hdr, sizeof(hdr), 1, hdmi_trace_file) != 1) {
+		fprintf(stderr, "hdmi-trace: failed to write header\n");
+		fclose(hdmi_trace_file);
+		hdmi_trace_file = NULL;
+	}
+
+out:
+	pthread_mutex_unlock(&hdmi_lock);
+}
+
+__attribute__((constructor)) static void hdmi_trace_init(void)
+{
+	const char *frames;
+
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_mmap = dlsym(RTLD_NEXT, "mmap");
+	real_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+	real_munmap = dlsym(RTLD_NEXT, "munmap");
+
+	frames = getenv("HDMI_TRACE_FRAMES");
+	hdmi_trace_frames = frames == NULL || strcmp(frames, "0") != 0;
+
+	pthread_atfork(NULL, NULL, hdmi_trace_atfork_child);
+}
+
+__attribute__((destructor)) static void hdmi_trace_fini(void)
+{
+	pthread_mutex_lock(&hdmi_lock);
+	// Capture whatever was last drawn, in case the application exits
+	// without a final VSync wait
+	hdmi_emit_frame(hdmi_now_ns());
+	if (hdmi_trace_file != NULL) {
+		fclose(hdmi_trace_file);
+		hdmi_trace_file = NULL;
+	}
+	pthread_mutex_unlock(&hdmi_lock);
+}
+
+/*******************************************************************************
+ * Interposed Functions
+ ******************************************************************************/
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+	int err;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (hdmi_in_shim || !hdmi_fd_is_fb(fd))
+		return real_ioctl(fd, request, arg);
+	hdmi_in_shim = true;
+
+	switch (request) {
+	case FBIO_WAITFORVSYNC: {
+		struct fb_vblank vbl;
+		uint32_t fid;
+
+		// The application is done drawing, so this is the frame
+		// boundary
+		pthread_mutex_lock(&hdmi_lock);
+		hdmi_emit_frame(hdmi_now_ns());
+		pthread_mutex_unlock(&hdmi_lock);
+
+		start = hdmi_now_ns();
+		ret = real_ioctl(fd, request, arg);
+		err = errno;
+		end = hdmi_now_ns();
+		fid = real_ioctl(fd, FBIOGET_VBLANK, &vbl) == 0 ?
+			      vbl.count :
+			      HDMI_TRACE_NO_FID;
+
+		pthread_mutex_lock(&hdmi_lock);
+		hdmi_emit(HDMI_TRACE_WAITFORVSYNC, start,
+			  (uint32_t)((end - start) / 1000u), fid, NULL, 0);
+		// We already captured this frame, so polling during it
+		// shouldn't capture it again
+		hdmi_last_fid = fid;
+		hdmi_have_fid = fid != HDMI_TRACE_NO_FID;
+		pthread_mutex_unlock(&hdmi_lock);
+		break;
+	}
+
+	case FBIOGET_VBLANK: {
+		const struct fb_vblank *vbl = arg;
+
+		start = hdmi_now_ns();
+		ret = real_ioctl(fd, request, arg);
+		err = errno;
+		if (ret == 0) {
+			pthread_mutex_lock(&hdmi_lock);
+			// A new frame ID means the frame the application
+			// drew while polling is done, so it's a frame boundary
+			if (hdmi_have_fid && vbl->count != hdmi_last_fid)
+				hdmi_emit_frame(start);
+			hdmi_last_fid = vbl->count;
+			hdmi_have_fid = true;
+			hdmi_emit(HDMI_TRACE_GETVBLANK, start, vbl->count,
+				  vbl->vcount, NULL, 0);
+			pthread_mutex_unlock(&hdmi_lock);
+		}
+		break;
+	}
+
+	case FBIOPUT_VSCREENINFO: {
+		uint32_t bpp;
+		uint32_t line_len;
+
+		start = hdmi_now_ns();
+		ret = real_ioctl(fd, request, arg);
+		err = errno;
+		if (ret == 0 && hdmi_read_mode(fd, &bpp, &line_len)) {
+			pthread_mutex_lock(&hdmi_lock);
+			if (bpp != hdmi_bpp || line_len != hdmi_line_len) {
+				hdmi_bpp = bpp;
+				hdmi_line_len = line_len;
+				hdmi_have_keyframe = false;
+				hdmi_emit(HDMI_TRACE_MODE, start, bpp, line_len,
+					  NULL, 0);
+			}
+			pthread_mutex_unlock(&hdmi_lock);
+		}
+		break;
+	}
+
+	default:
+		ret = real_ioctl(fd, request, arg);
+		err = errno;
+		break;
+	}
+
+	hdmi_in_shim = false;
+	errno = err;
+	return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	uint64_t start;
+	off_t off;
+	ssize_t ret;
+	int err;
+
+	if (hdmi_in_shim || !hdmi_fd_is_fb(fd))
+		return real_write(fd, buf, count);
+	hdmi_in_shim = true;
+
+	start = hdmi_now_ns();
+	off = lseek(fd, 0, SEEK_CUR);
+	ret = real_write(fd, buf, count);
+	err = errno;
+	// Only log what actually made it to the device
+	if (ret > 0 && off >= 0) {
+		pthread_mutex_lock(&hdmi_lock);
+		hdmi_emit(HDMI_TRACE_WRITE, start, (uint32_t)off, 0, buf,
+			  (uint32_t)ret);
+		pthread_mutex_unlock(&hdmi_lock);
+	}
+
+	hdmi_in_shim = false;
+	errno = err;
+	return ret;
+}
+
+int close(int fd)
+{
+	if (fd >= 0 && fd < HDMI_FD_TABLE_LEN)
+		hdmi_fd_table[fd] = HDMI_FD_UNKNOWN;
+	return real_close(fd);
+}
+
+/*
+ * Remember where the application mapped the framebuffer so we can snapshot it
+ * at frame boundaries.
+ */
+static void hdmi_note_mmap(void *addr, size_t len, int fd)
+{
+	if (addr == MAP_FAILED || hdmi_in_shim || !hdmi_fd_is_fb(fd))
+		return;
+	pthread_mutex_lock(&hdmi_lock);
+	hdmi_map_addr = addr;
+	hdmi_map_len = len;
+	hdmi_have_keyframe = false;
+	pthread_mutex_unlock(&hdmi_lock);
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+	void *ret = real_mmap(addr, len, prot, flags, fd, off);
+	hdmi_note_mmap(ret, len, fd);
+	return ret;
+}
+
+void *mmap64(void *addr, size_t len, int prot, int flags, int fd, off64_t off)
+{
+	void *ret = real_mmap64(addr, len, prot, flags, fd, off);
+	hdmi_note_mmap(ret, len, fd);
+	return ret;
+}
+
+int munmap(void *addr, size_t len)
+{
+	pthread_mutex_lock(&hdmi_lock);
+	if (addr == hdmi_map_addr) {
+		// Last chance to see what was drawn
+		hdmi_emit_frame(hdmi_now_ns());
+		hdmi_map_addr = NULL;
+		hdmi_map_len = 0;
+	}
+	pthread_mutex_unlock(&hdmi_lock);
+	return real_munmap(addr, len);
+}
@@ -0,0 +1,434 @@
+/*
+ * Display workload replayer for the HDMI Peripheral. This takes a trace made
+ * by `libhdmi-trace.so` and plays it back against the driver, then reports
+ * how well the display kept up. Use it as:
+ *
+ *   hdmi-trace-replay [-d /dev/fbN] [-m] app.trace
+ *
+ * By default, records are replayed at the pace they were recorded. With `-m`,
+ * records are replayed as fast as possible. Either way, the VSync waits in the
+ * trace are still issued, so the driver stays in the loop.
+ *
+ * The framebuffer is switched to the color depth the trace was recorded at, and
+ * follows any changes the trace records. The original depth is restored at the
+ * end. The 8bpp palette isn't recorded, so emulated 8bpp replays with whatever
+ * palette is loaded.
+ *
+ * A frame boundary is a VSync wait, or a VBlank query that saw a new frame ID
+ * in the trace, which is how the recorder finds the boundaries of applications
+ * that pace themselves by polling. The report covers:
+ *   * frame pacing: the interval between successive frame boundaries,
+ *   * missed VBlanks: frames where more VBlanks elapsed between boundaries
+ *     than did when the trace was recorded, and
+ *   * CPU cost: the time we spent on the CPU, both overall and per frame.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "hdmi-trace.h"
+
+/*
+ * The frame ID from the hardware is only twelve bits wide, so differences have
+ * to be taken modulo this.
+ */
+#define HDMI_FID_MOD 4096u
+
+/*******************************************************************************
+ * Statistics
+ ******************************************************************************/
+
+struct hdmi_stat {
+	uint64_t n;
+	double sum;
+	double sum_sq;
+	double min;
+	double max;
+};
+
+static void hdmi_stat_add(struct hdmi_stat *s, double v)
+{
+	if (s->n == 0 || v < s->min)
+		s->min = v;
+	if (s->n == 0 || v > s->max)
+		s->max = v;
+	s->n++;
+	s->sum += v;
+	s->sum_sq += v * v;
+}
+
+static void hdmi_stat_print(const char *name, const struct hdmi_stat *s)
+{
+	double mean;
+	double var;
+
+	if (s->n == 0) {
+		printf("%-22s (no samples)\n", name);
+		return;
+	}
+	mean = s->sum / (double)s->n;
+	var = s->sum_sq / (double)s->n - mean * mean;
+	printf("%-22s mean %9.3f  sd %9.3f  min %9.3f  max %9.3f  (n=%llu)\n",
+	       name, mean, var > 0.0 ? sqrt(var) : 0.0, s->min, s->max,
+	       (unsigned long long)s->n);
+}
+
+/*
+ * Frame boundaries seen so far, along with the frame IDs at the last one, both
+ * from the trace and from the replay.
+ */
+struct hdmi_boundaries {
+	uint64_t frames;
+	uint64_t missed;
+	uint64_t last_ns;
+	uint32_t last_trace_fid;
+	uint32_t last_replay_fid;
+	struct hdmi_stat pacing_ms;
+};
+
+/*
+ * Account for a frame boundary at `when_ns`. Compare how many VBlanks went by
+ * since the last boundary against what happened during recording.
+ */
+static void hdmi_boundary(struct hdmi_boundaries *b, uint64_t when_ns,
+			  uint32_t replay_fid, uint32_t trace_fid)
+{
+	b->frames++;
+	if (b->last_ns != 0)
+		hdmi_stat_add(&b->pacing_ms,
+			      (double)(when_ns - b->last_ns) / 1e6);
+	b->last_ns = when_ns;
+
+	if (replay_fid != HDMI_TRACE_NO_FID && trace_fid != HDMI_TRACE_NO_FID &&
+	    b->last_replay_fid != HDMI_TRACE_NO_FID &&
+	    b->last_trace_fid != HDMI_TRACE_NO_FID) {
+		uint32_t got = (replay_fid - b->last_replay_fid) % HDMI_FID_MOD;
+		uint32_t want = (trace_fid - b->last_trace_fid) % HDMI_FID_MOD;
+		if (got > want)
+			b->missed += got - want;
+	}
+	b->last_replay_fid = replay_fid;
+	b->last_trace_fid = trace_fid;
+}
+
+/*******************************************************************************
+ * Helper Functions
+ ******************************************************************************/
+
+static uint64_t hdmi_clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void hdmi_sleep_until_ns(uint64_t when_ns)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(when_ns / 1000000000ull);
+	ts.tv_nsec = (long)(when_ns % 1000000000ull);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static bool hdmi_read_fid(int fd, uint32_t *fid)
+{
+	struct fb_vblank vbl;
+	if (ioctl(fd, FBIOGET_VBLANK, &vbl) != 0)
+		return false;
+	*fid = vbl.count;
+	return true;
+}
+
+/*
+ * Switch the framebuffer to `bpp`, and map it. Any previous mapping in `*fb` is
+ * unmapped first, since the driver exposes a different buffer at each depth.
+ * Returns false if the driver doesn't give us the line length we expect.
+ */
+static bool hdmi_set_mode(int fd, uint32_t bpp, uint32_t line_len,
+			  unsigned char **fb, size_t *fb_len)
+{
+	struct fb_var_screeninfo var;
+	struct fb_fix_screeninfo fix;
+
+	if (*fb != NULL) {
+		munmap(*fb, *fb_len);
+		*fb = NULL;
+		*fb_len = 0;
+	}
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &var) != 0) {
+		perror("failed to read the screen info");
+		return false;
+	}
+	var.bits_per_pixel = bpp;
+	if (ioctl(fd, FBIOPUT_VSCREENINFO, &var) != 0) {
+		fprintf(stderr, "failed to set %ubpp: %s\n", (unsigned)bpp,
+			strerror(errno));
+		return false;
+	}
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &fix) != 0) {
+		perror("failed to read the fixed screen info");
+		return false;
+	}
+	if (fix.line_length != line_len ||
+	    fix.smem_len < line_len * HDMI_TRACE_YRES) {
+		fprintf(stderr,
+			"at %ubpp, the line length is %u rather than %u\n",
+			(unsigned)bpp, fix.line_length, (unsigned)line_len);
+		return false;
+	}
+
+	*fb = mmap(NULL, fix.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   0);
+	if (*fb == MAP_FAILED) {
+		perror("failed to map framebuffer");
+		*fb = NULL;
+		return false;
+	}
+	*fb_len = fix.smem_len;
+	return true;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-d /dev/fbN] [-m] TRACE\n", argv0);
+	exit(2);
+}
+
+/*******************************************************************************
+ * Replay
+ ******************************************************************************/
+
+int main(int argc, char **argv)
+{
+	const char *dev = "/dev/fb0";
+	bool max_speed = false;
+	struct hdmi_trace_header hdr;
+	struct hdmi_trace_record rec;
+	struct fb_var_screeninfo orig_var;
+	unsigned char *payload;
+	unsigned char *fb = NULL;
+	size_t fb_len = 0;
+	uint32_t line_len;
+	bool failed = false;
+	FILE *trace;
+	int fd;
+	int opt;
+
+	struct hdmi_boundaries bounds = {
+		.last_trace_fid = HDMI_TRACE_NO_FID,
+		.last_replay_fid = HDMI_TRACE_NO_FID,
+	};
+	struct hdmi_stat wait_ms = { 0 };
+	struct hdmi_stat frame_cpu_ms = { 0 };
+	struct rusage ru;
+	uint64_t replay_start;
+	uint64_t records = 0;
+	uint64_t bytes = 0;
+
+	while ((opt = getopt(argc, argv, "d:m")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 'm':
+			max_speed = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	trace = fopen(argv[optind], "rb");
+	if (trace == NULL) {
+		perror("failed to open trace");
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, trace) != 1 ||
+	    hdr.magic != HDMI_TRACE_MAGIC ||
+	    hdr.version != HDMI_TRACE_VERSION ||
+	    hdr.xres != HDMI_TRACE_XRES || hdr.yres != HDMI_TRACE_YRES ||
+	    hdr.line_length == 0 ||
+	    hdr.line_length > HDMI_TRACE_MAX_LINE_LEN) {
+		fprintf(stderr, "not a trace we understand: %s\n",
+			argv[optind]);
+		return 1;
+	}
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror("failed to open framebuffer");
+		return 1;
+	}
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &orig_var) != 0) {
+		perror("failed to read the screen info");
+		return 1;
+	}
+	line_len = hdr.line_length;
+	if (!hdmi_set_mode(fd, hdr.bits_per_pixel, line_len, &fb, &fb_len))
+		return 1;
+	payload = malloc(HDMI_TRACE_LINEMAP_LEN + HDMI_TRACE_MAX_BUF_LEN);
+	if (payload == NULL) {
+		perror("failed to allocate payload buffer");
+		return 1;
+	}
+
+	replay_start = hdmi_clock_ns(CLOCK_MONOTONIC);
+	while (!failed && fread(&rec, sizeof(rec), 1, trace) == 1) {
+		uint64_t cpu_start;
+		uint64_t cpu_end;
+
+		if (rec.len > HDMI_TRACE_LINEMAP_LEN + HDMI_TRACE_MAX_BUF_LEN ||
+		    (rec.len != 0 && fread(payload, rec.len, 1, trace) != 1)) {
+			fprintf(stderr, "truncated or corrupt record %llu\n",
+				(unsigned long long)records);
+			failed = true;
+			break;
+		}
+		records++;
+
+		if (!max_speed)
+			hdmi_sleep_until_ns(replay_start + rec.time_ns);
+
+		switch (rec.type) {
+		case HDMI_TRACE_FRAME: {
+			const unsigned char *data;
+			unsigned line;
+
+			cpu_start = hdmi_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+			data = payload + HDMI_TRACE_LINEMAP_LEN;
+			for (line = 0; line < HDMI_TRACE_YRES; line++) {
+				if ((payload[line / 8] & (1u << (line % 8))) ==
+				    0)
+					continue;
+				if (data + line_len > payload + rec.len)
+					break;
+				memcpy(fb + line * line_len, data, line_len);
+				data += line_len;
+				bytes += line_len;
+			}
+			cpu_end = hdmi_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+			hdmi_stat_add(&frame_cpu_ms,
+				      (double)(cpu_end - cpu_start) / 1e6);
+			break;
+		}
+
+		case HDMI_TRACE_WAITFORVSYNC: {
+			uint64_t start;
+			uint64_t end;
+			uint32_t arg = 0;
+			uint32_t fid;
+
+			start = hdmi_clock_ns(CLOCK_MONOTONIC);
+			if (ioctl(fd, FBIO_WAITFORVSYNC, &arg) != 0)
+				fprintf(stderr,
+					"FBIO_WAITFORVSYNC failed: %s\n",
+					strerror(errno));
+			end = hdmi_clock_ns(CLOCK_MONOTONIC);
+			hdmi_stat_add(&wait_ms, (double)(end - start) / 1e6);
+
+			// Each VSync wait is a frame boundary
+			if (!hdmi_read_fid(fd, &fid))
+				fid = HDMI_TRACE_NO_FID;
+			hdmi_boundary(&bounds, end, fid, rec.arg1);
+			break;
+		}
+
+		case HDMI_TRACE_GETVBLANK: {
+			struct fb_vblank vbl;
+			uint32_t fid = HDMI_TRACE_NO_FID;
+
+			if (ioctl(fd, FBIOGET_VBLANK, &vbl) != 0)
+				fprintf(stderr, "FBIOGET_VBLANK failed: %s\n",
+					strerror(errno));
+			else
+				fid = vbl.count;
+
+			// When the application saw a new frame ID, the recorder
+			// took a frame boundary, and the frame record for it
+			// comes just before this one. The very first query
+			// only tells us where we started.
+			if (bounds.last_trace_fid == HDMI_TRACE_NO_FID) {
+				bounds.last_trace_fid = rec.arg0;
+				bounds.last_replay_fid = fid;
+			} else if (rec.arg0 != bounds.last_trace_fid) {
+				hdmi_boundary(&bounds,
+					      hdmi_clock_ns(CLOCK_MONOTONIC),
+					      fid, rec.arg0);
+			}
+			break;
+		}
+
+		case HDMI_TRACE_WRITE: {
+			ssize_t res = pwrite(fd, payload, rec.len, rec.arg0);
+			if (res < 0)
+				fprintf(stderr, "write failed: %s\n",
+					strerror(errno));
+			else
+				bytes += (uint64_t)res;
+			break;
+		}
+
+		case HDMI_TRACE_MODE: {
+			// Stop rather than replay frames at the wrong depth,
+			// but still restore the original depth below
+			if (rec.arg1 == 0 ||
+			    rec.arg1 > HDMI_TRACE_MAX_LINE_LEN ||
+			    !hdmi_set_mode(fd, rec.arg0, rec.arg1, &fb,
+					   &fb_len)) {
+				failed = true;
+				break;
+			}
+			line_len = rec.arg1;
+			break;
+		}
+
+		default:
+			fprintf(stderr, "skipping unknown record type %u\n",
+				rec.type);
+			break;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("replayed %llu records, %llu frames, %llu bytes in %.3f s "
+	       "(%s)\n",
+	       (unsigned long long)records, (unsigned long long)bounds.frames,
+	       (unsigned long long)bytes,
+	       (double)(hdmi_clock_ns(CLOCK_MONOTONIC) - replay_start) / 1e9,
+	       max_speed ? "maximum speed" : "original speed");
+	hdmi_stat_print("frame pacing (ms)", &bounds.pacing_ms);
+	hdmi_stat_print("vsync wait (ms)", &wait_ms);
+	hdmi_stat_print("frame copy cpu (ms)", &frame_cpu_ms);
+	printf("%-22s %llu\n", "missed vblanks",
+	       (unsigned long long)bounds.missed);
+	printf("%-22s user %.3f s  sys %.3f s\n", "cpu time",
+	       (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6,
+	       (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6);
+
+	free(payload);
+	munmap(fb, fb_len);
+	if (ioctl(fd, FBIOPUT_VSCREENINFO, &orig_var) != 0)
+		perror("failed to restore the screen info");
+	close(fd);
+	fclose(trace);
+	return failed ? 1 : 0;
+}
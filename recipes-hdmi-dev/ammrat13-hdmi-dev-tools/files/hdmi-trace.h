@@ -0,0 +1,102 @@
+#ifndef HDMI_TRACE_H
+#define HDMI_TRACE_H
+
+#include <stdint.h>
+
+/*******************************************************************************
+ * Trace Format
+ *
+ * A trace is a `struct hdmi_trace_header` followed by a sequence of records.
+ * Each record is a `struct hdmi_trace_record` followed by `len` bytes of
+ * payload. Everything is stored in the native byte order of the machine that
+ * recorded it, since traces are only ever replayed on the same hardware.
+ ******************************************************************************/
+
+#define HDMI_TRACE_MAGIC 0x54494d48u /* "HMIT" */
+#define HDMI_TRACE_VERSION 2u
+
+/*
+ * The resolution of the framebuffer is fixed by the hardware. We still record
+ * it in the header so the replay tool can refuse traces it doesn't understand.
+ * The color depth isn't fixed, since the driver emulates 8bpp and 16bpp, so the
+ * line length depends on it. It's recorded in the header, and again in a mode
+ * record whenever it changes. These are the largest a line and a buffer can be.
+ */
+#define HDMI_TRACE_XRES 640u
+#define HDMI_TRACE_YRES 480u
+#define HDMI_TRACE_MAX_LINE_LEN (640u * 4u)
+#define HDMI_TRACE_MAX_BUF_LEN (HDMI_TRACE_MAX_LINE_LEN * HDMI_TRACE_YRES)
+
+/*
+ * Size of the bitmap of dirty lines at the start of a frame record's payload.
+ */
+#define HDMI_TRACE_LINEMAP_LEN ((HDMI_TRACE_YRES + 7u) / 8u)
+
+/*
+ * Sentinel for when the frame ID could not be read after a VSync wait.
+ */
+#define HDMI_TRACE_NO_FID 0xffffffffu
+
+struct hdmi_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t xres;
+	uint32_t yres;
+	/* The depth and line length when the recording started */
+	uint32_t line_length;
+	uint32_t bits_per_pixel;
+	/* `CLOCK_MONOTONIC` time the recording started, in nanoseconds */
+	uint64_t start_ns;
+};
+
+enum hdmi_trace_type {
+	/*
+	 * The contents of the mmapped buffer at a frame boundary. We take a
+	 * frame boundary to be the point where the application starts waiting
+	 * for VSync, or where it first sees a new frame ID from
+	 * `FBIOGET_VBLANK` when it paces itself by polling. The payload is a
+	 * bitmap of dirty lines, followed by the contents of each dirty line in
+	 * order. Lines are compared by hash against the previous frame, so the
+	 * first frame is always a full keyframe.
+	 *   `arg0`: number of dirty lines
+	 */
+	HDMI_TRACE_FRAME = 1,
+	/*
+	 * A call to `ioctl(FBIO_WAITFORVSYNC)`. The timestamp is when the call
+	 * was made. No payload.
+	 *   `arg0`: time spent in the call, in microseconds
+	 *   `arg1`: frame ID after the call returned, or `HDMI_TRACE_NO_FID`
+	 */
+	HDMI_TRACE_WAITFORVSYNC = 2,
+	/*
+	 * A call to `ioctl(FBIOGET_VBLANK)`. No payload.
+	 *   `arg0`: the `count` field returned
+	 *   `arg1`: the `vcount` field returned
+	 */
+	HDMI_TRACE_GETVBLANK = 3,
+	/*
+	 * A call to `write` on the framebuffer, which goes through
+	 * `fb_sys_write`. The payload is the data that was written.
+	 *   `arg0`: file offset the write started at
+	 */
+	HDMI_TRACE_WRITE = 4,
+	/*
+	 * The color depth changed, say through `ioctl(FBIOPUT_VSCREENINFO)`.
+	 * Frame records after this one use the new line length. No payload.
+	 *   `arg0`: the new `bits_per_pixel`
+	 *   `arg1`: the new `line_length`
+	 */
+	HDMI_TRACE_MODE = 5,
+};
+
+struct hdmi_trace_record {
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t len;
+	/* Nanoseconds since `start_ns` in the header */
+	uint64_t time_ns;
+	uint32_t arg0;
+	uint32_t arg1;
+};
+
+#endif /* HDMI_TRACE_H */